@@ -0,0 +1,127 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * AccountIndex.cpp
+ * Implementation for the AccountBitmap and AccountIndex classes.
+ */
+
+#include "acctindex.h"
+
+void AccountBitmap::set(uint32_t id) {
+  if(id / 64 >= _words.size())
+    _words.resize(id / 64 + 1, 0);
+  _words[id / 64] |= uint64_t(1) << (id % 64);
+}
+
+void AccountBitmap::reset(uint32_t id) {
+  if(id / 64 < _words.size())
+    _words[id / 64] &= ~(uint64_t(1) << (id % 64));
+}
+
+size_t AccountBitmap::count() const {
+  size_t total = 0;
+  for(uint64_t word : _words)
+    total += __builtin_popcountll(word);
+  return total;
+}
+
+AccountBitmap& AccountBitmap::operator&=(const AccountBitmap& rhs) {
+  //words past the end of rhs have no bits set
+  if(_words.size() > rhs._words.size())
+    _words.resize(rhs._words.size());
+  for(size_t w = 0; w < _words.size(); w++)
+    _words[w] &= rhs._words[w];
+  return *this;
+}
+
+AccountBitmap& AccountBitmap::operator|=(const AccountBitmap& rhs) {
+  if(_words.size() < rhs._words.size())
+    _words.resize(rhs._words.size(), 0);
+  for(size_t w = 0; w < rhs._words.size(); w++)
+    _words[w] |= rhs._words[w];
+  return *this;
+}
+
+AccountBitmap& AccountBitmap::operator-=(const AccountBitmap& rhs) {
+  size_t shared = std::min(_words.size(), rhs._words.size());
+  for(size_t w = 0; w < shared; w++)
+    _words[w] &= ~rhs._words[w];
+  return *this;
+}
+
+AccountBitmap operator&(AccountBitmap lhs, const AccountBitmap& rhs) {lhs &= rhs; return lhs;}
+AccountBitmap operator|(AccountBitmap lhs, const AccountBitmap& rhs) {lhs |= rhs; return lhs;}
+AccountBitmap operator-(AccountBitmap lhs, const AccountBitmap& rhs) {lhs -= rhs; return lhs;}
+
+/**
+ * Gives an account a dense id, reusing freed ones first, and sets its bits.
+ * @param acct live account that is not in the index yet
+ */
+void AccountIndex::add(const Account& acct) {
+  uint32_t id;
+  if(!_freeIds.empty()) {
+    id = _freeIds.back();
+    _freeIds.pop_back();
+    _accounts[id] = acct;
+  } else {
+    id = static_cast<uint32_t>(_accounts.size());
+    _accounts.push_back(acct);
+  }
+  _ids.emplace(Key{acct._username, acct.getDiscriminator()}, id);
+
+  _live.set(id);
+  if(acct.hasNitro())
+    _nitro.set(id);
+  if(!acct.getStatus().empty())
+    _hasStatus.set(id);
+  if(acct.getBadgeId() >= static_cast<int>(_badges.size()))
+    _badges.resize(acct.getBadgeId() + 1);
+  _badges[acct.getBadgeId()].set(id);
+}
+
+/**
+ * Clears an account's bits and frees its id.
+ * @param acct account with the same username and discriminator as an indexed one
+ * @return true if the account was in the index, false otherwise
+ */
+bool AccountIndex::remove(const Account& acct) {
+  auto found = _ids.find(Key{acct._username, acct.getDiscriminator()});
+  if(found == _ids.end())
+    return false;
+
+  uint32_t id = found->second;
+  _ids.erase(found);
+  _live.reset(id);
+  _nitro.reset(id);
+  _hasStatus.reset(id);
+  _badges[_accounts[id].getBadgeId()].reset(id);
+  _freeIds.push_back(id);
+  return true;
+}
+
+void AccountIndex::clear() {
+  _accounts.clear();
+  _freeIds.clear();
+  _ids.clear();
+  _live.clear();
+  _nitro.clear();
+  _hasStatus.clear();
+  _badges.clear();
+}
+
+const AccountBitmap& AccountIndex::withBadge(std::string_view badge) const {
+  static const AccountBitmap none;
+  int badgeId = BadgeDictionary::find(badge);
+  return (badgeId < 0 || badgeId >= static_cast<int>(_badges.size()) ? none : _badges[badgeId]);
+}
+
+size_t AccountIndex::getBytesAllocated() const {
+  size_t bytes = _accounts.capacity() * sizeof(Account) + _freeIds.capacity() * sizeof(uint32_t) +
+                 _ids.size() * (sizeof(Key) + sizeof(uint32_t) + 2 * sizeof(void*)) +
+                 _ids.bucket_count() * sizeof(void*);
+  bytes += _live.getBytesAllocated() + _nitro.getBytesAllocated() + _hasStatus.getBytesAllocated();
+  bytes += _badges.capacity() * sizeof(AccountBitmap);
+  for(const AccountBitmap& badge : _badges)
+    bytes += badge.getBytesAllocated();
+  return bytes;
+}
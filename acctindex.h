@@ -0,0 +1,108 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * AccountIndex.h
+ * Secondary bitmap indexes over the accounts of a UTree.
+ */
+
+#pragma once
+
+#include "dtree.h"
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+/**
+ * A set of dense account ids, one bit per id. Ids are handed out densely and
+ * reused, so plain words stay compact without run-length compression.
+ */
+class AccountBitmap {
+public:
+    void set(uint32_t id);
+    void reset(uint32_t id);
+    bool test(uint32_t id) const {return id / 64 < _words.size() && (_words[id / 64] >> (id % 64) & 1);}
+    size_t count() const;
+    void clear() {_words.clear();}
+
+    /* Filters, NOT is AccountIndex::negate() since it needs the set of live ids */
+    AccountBitmap& operator&=(const AccountBitmap& rhs);
+    AccountBitmap& operator|=(const AccountBitmap& rhs);
+    AccountBitmap& operator-=(const AccountBitmap& rhs);
+
+    /**
+     * Calls visit with every id in the set, in increasing order.
+     * @param visit callable taking a uint32_t id
+     */
+    template <class Visitor>
+    void forEach(Visitor visit) const {
+        for(size_t w = 0; w < _words.size(); w++) {
+            for(uint64_t word = _words[w]; word != 0; word &= word - 1)
+                visit(static_cast<uint32_t>(w * 64 + __builtin_ctzll(word)));
+        }
+    }
+
+    size_t getBytesAllocated() const {return _words.capacity() * sizeof(uint64_t);}
+
+private:
+    std::vector<uint64_t> _words;
+};
+
+AccountBitmap operator&(AccountBitmap lhs, const AccountBitmap& rhs);
+AccountBitmap operator|(AccountBitmap lhs, const AccountBitmap& rhs);
+AccountBitmap operator-(AccountBitmap lhs, const AccountBitmap& rhs);
+
+/**
+ * Gives every live account a dense id and keeps a bitmap per attribute, so
+ * filters on nitro, badge and status presence are answered with word-wide
+ * AND/OR/NOT instead of a walk over every DTree. The owning UTree keeps it in
+ * step with every insertion and removal.
+ */
+class AccountIndex {
+public:
+    void add(const Account& acct);
+    bool remove(const Account& acct);
+    void clear();
+
+    /* Bitmaps to combine into filters */
+    const AccountBitmap& all() const {return _live;}
+    const AccountBitmap& nitro() const {return _nitro;}
+    const AccountBitmap& hasStatus() const {return _hasStatus;}
+    const AccountBitmap& withBadge(std::string_view badge) const;
+    AccountBitmap negate(const AccountBitmap& matches) const {return _live - matches;}
+
+    const Account& account(uint32_t id) const {return _accounts[id];}
+
+    /**
+     * Calls visit with every account in a filter result, in id order.
+     * @param matches bitmap built from this index
+     * @param visit callable taking a const Account&
+     */
+    template <class Visitor>
+    void forEach(const AccountBitmap& matches, Visitor visit) const {
+        matches.forEach([&](uint32_t id) {visit(_accounts[id]);});
+    }
+
+    size_t getNumAccounts() const {return _ids.size();}
+    size_t getBytesAllocated() const;
+
+private:
+    /* Pooled usernames are unique, so the pointer and discriminator identify an account */
+    struct Key {
+        const string* username;
+        int disc;
+        bool operator==(const Key& rhs) const {return username == rhs.username && disc == rhs.disc;}
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return std::hash<const void*>()(key.username) * 31 + static_cast<size_t>(key.disc);
+        }
+    };
+
+    std::vector<Account> _accounts;           /* Indexed by id, stale where the id is free */
+    std::vector<uint32_t> _freeIds;
+    std::unordered_map<Key, uint32_t, KeyHash> _ids;
+    AccountBitmap _live;
+    AccountBitmap _nitro;
+    AccountBitmap _hasStatus;
+    std::vector<AccountBitmap> _badges;      /* Indexed by badge id, grown as badges are seen */
+};
@@ -0,0 +1,710 @@
+#include "utree.h"
+#include "utree.cpp"
+#include "dtree.h"
+#include "dtree.cpp"
+#include "strpool.cpp"
+#include "acctindex.cpp"
+#include "treestats.cpp"
+#include "cutree.h"
+#include "cutree.cpp"
+#include "journal.h"
+#include "journal.cpp"
+#include "dutree.h"
+#include "dutree.cpp"
+#include <random>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <functional>
+#include <cmath>
+
+#define NUMROWS 2000000
+#define ACCTS_PER_NAME 20
+#define BENCH_FILE "bench_accounts.csv"
+#define LOOKUPS_PER_THREAD 200000
+#define ALLOC_BENCH_ROWS 200000
+#define MEMORY_BENCH_ROWS 200000
+#define MEMORY_BENCH_ACCTS_PER_NAME 5
+#define BATCH_LOOKUPS 2000000
+#define SUITE_MIN_ROWS 1000
+#define SUITE_MAX_ROWS 1000000
+#define SUITE_FILE "bench_results.csv"
+#define SUITE_LOAD_RUNS 5
+#define ZIPF_SKEW 1.0
+#define COPY_BENCH_COPIES 1000
+#define JOURNAL_BENCH_SECONDS 1.0
+#define JOURNAL_BENCH_DELAY_US 200
+
+/* Every heap allocation in the process is counted so benchmarks can report allocations per operation */
+std::atomic<long> numAllocations(0);
+std::atomic<long> numBytesRequested(0);
+
+/*
+ * Every replaceable form of new and delete goes through these two, so the array,
+ * sized and nothrow forms stay paired. They are kept out of line so the compiler
+ * never sees malloc and free meet a new-expression at a call site.
+ */
+__attribute__((noinline)) void* countedAllocate(size_t size) noexcept {
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    numBytesRequested.fetch_add(static_cast<long>(size), std::memory_order_relaxed);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+__attribute__((noinline)) void countedRelease(void* block) noexcept {std::free(block);}
+
+void* operator new(size_t size) {
+    if(void* block = countedAllocate(size)) return block;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    if(void* block = countedAllocate(size)) return block;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {return countedAllocate(size);}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {return countedAllocate(size);}
+
+void operator delete(void* block) noexcept {countedRelease(block);}
+void operator delete[](void* block) noexcept {countedRelease(block);}
+void operator delete(void* block, size_t) noexcept {countedRelease(block);}
+void operator delete[](void* block, size_t) noexcept {countedRelease(block);}
+void operator delete(void* block, const std::nothrow_t&) noexcept {countedRelease(block);}
+void operator delete[](void* block, const std::nothrow_t&) noexcept {countedRelease(block);}
+
+std::mt19937 rng(10);
+std::uniform_int_distribution<> distAcct(0, 9999);
+
+class Bencher {
+public:
+    void writeAccounts(string file, int numRows);
+
+    void benchLoadScaling(string file, int numRows, int maxThreads);
+
+    void benchReadScaling(string file, int maxThreads);
+
+    void benchSnapshot(string file, int numRows);
+
+    void benchAllocations(int numRows);
+
+    void benchMemory(int numRows);
+
+    void benchBatchLookups(string file, int numRows);
+
+    void benchSecondaryIndex(string file);
+
+    void benchCopies(string file, int numRows);
+
+    void benchJournal(string file, int maxThreads);
+
+    void runSuite(int maxRows, string outFile, string label);
+
+private:
+    /* One (username, discriminator) per operation, in the order the workload issues them */
+    struct Workload {
+        string name;
+        std::vector<string> usernames;
+        std::vector<int> discs;
+    };
+
+    Workload makeWorkload(const string& name, int numRows);
+    void writeWorkload(const Workload& workload, const string& file);
+    void report(std::ostream& out, const string& label, const Workload& workload, const string& op,
+                double seconds, std::vector<long>& latencies);
+
+    /**
+     * Runs op(i) for every operation of a workload, timing each call.
+     * @param count number of operations
+     * @param op callable taking the operation index
+     * @param latencies filled with the nanoseconds each call took
+     * @return total seconds, including the timer reads
+     */
+    template <class Op>
+    double timeEach(int count, Op op, std::vector<long>& latencies);
+
+    template <class Job>
+    double timeSeconds(Job job);
+};
+
+void Bencher::writeAccounts(string file, int numRows) {
+    std::ofstream out(file);
+    std::uniform_int_distribution<> distName(0, numRows / ACCTS_PER_NAME);
+    for(int i = 0; i < numRows; i++) {
+        out << "user" << distName(rng) << "," << distAcct(rng) << "," << (i % 3 == 0) << ","
+            << (i % 4 == 0 ? "Subscriber" : "") << "," << (i % 5 == 0 ? "This is a status" : "") << "\n";
+    }
+}
+
+void Bencher::benchLoadScaling(string file, int numRows, int maxThreads) {
+    cout << "mode,threads,seconds,rows_per_sec" << endl;
+
+    double seconds = timeSeconds([&]() { UTree utree; utree.loadData(file); });
+    cout << "incremental,1," << seconds << "," << numRows / seconds << endl;
+
+    seconds = timeSeconds([&]() { UTree utree; utree.loadData(file, true, true); });
+    cout << "bulk,1," << seconds << "," << numRows / seconds << endl;
+
+    for(int threads = 1; threads <= maxThreads; threads *= 2) {
+        seconds = timeSeconds([&]() { UTree utree; utree.loadDataParallel(file, threads); });
+        cout << "parallel," << threads << "," << seconds << "," << numRows / seconds << endl;
+    }
+}
+
+void Bencher::benchReadScaling(string file, int maxThreads) {
+    cout << "mode,threads,seconds,lookups_per_sec" << endl;
+
+    ConcurrentUTree ctree;
+    ctree.loadData(file);
+    UTree locked;
+    locked.loadData(file, true, true);
+    std::mutex lock;
+
+    for(int threads = 1; threads <= maxThreads; threads *= 2) {
+        /* Left-Right readers against one global mutex around a plain UTree */
+        for(int useMutex = 0; useMutex <= 1; useMutex++) {
+            double seconds = timeSeconds([&]() {
+                std::vector<std::thread> workers;
+                for(int t = 0; t < threads; t++) {
+                    workers.emplace_back([&, t]() {
+                        std::mt19937 localRng(t);
+                        std::uniform_int_distribution<> distName(0, 1000);
+                        std::uniform_int_distribution<> distDisc(MIN_DISC, MAX_DISC);
+                        Account found;
+                        for(int i = 0; i < LOOKUPS_PER_THREAD; i++) {
+                            string username = "user" + std::to_string(distName(localRng));
+                            int disc = distDisc(localRng);
+                            if(useMutex) {
+                                std::lock_guard<std::mutex> guard(lock);
+                                locked.retrieveUser(username, disc);
+                            } else {
+                                ctree.retrieveUser(username, disc, found);
+                            }
+                        }
+                    });
+                }
+                for(std::thread& worker : workers) worker.join();
+            });
+            cout << (useMutex ? "mutex," : "left_right,") << threads << "," << seconds << ","
+                 << threads * LOOKUPS_PER_THREAD / seconds << endl;
+        }
+    }
+}
+
+void Bencher::benchSnapshot(string file, int numRows) {
+    cout << "mode,seconds,rows_per_sec" << endl;
+    string snapshotFile = string(file) + ".snap";
+
+    UTree source;
+    source.loadData(file, true, true);
+    double seconds = timeSeconds([&]() { source.saveSnapshot(snapshotFile); });
+    cout << "snapshot_save," << seconds << "," << numRows / seconds << endl;
+
+    seconds = timeSeconds([&]() { UTree utree; utree.loadSnapshot(snapshotFile); });
+    cout << "snapshot_load," << seconds << "," << numRows / seconds << endl;
+
+    std::remove(snapshotFile.c_str());
+}
+
+void Bencher::benchAllocations(int numRows) {
+    cout << "mode,inserts,allocations,allocations_per_insert" << endl;
+
+    /* Field text lives outside the tree, the way a parser or network buffer would hold it */
+    std::vector<string> names;
+    for(int i = 0; i < numRows / ACCTS_PER_NAME + 1; i++) names.push_back("user" + std::to_string(i));
+    const string badge = "Subscriber";
+    const string status = "This is a status";
+
+    auto report = [](const char* mode, int inserts, long allocations) {
+        cout << mode << "," << inserts << "," << allocations << ","
+             << static_cast<double>(allocations) / inserts << endl;
+    };
+
+    /* First pass interns every string and grows the node pools */
+    UTree utree;
+    long before = numAllocations.load();
+    for(int i = 0; i < numRows; i++)
+        utree.emplace(names[i % names.size()], i % (MAX_DISC + 1), i % 3 == 0, badge, status);
+    report("emplace_cold", numRows, numAllocations.load() - before);
+
+    /* Second pass finds every account already live, only the lookups and interning run */
+    before = numAllocations.load();
+    for(int i = 0; i < numRows; i++)
+        utree.emplace(names[i % names.size()], i % (MAX_DISC + 1), i % 3 == 0, badge, status);
+    report("emplace_existing", numRows, numAllocations.load() - before);
+
+    /* Reinserting removed accounts reuses vacant nodes, the pools' free lists, and pooled strings */
+    Account removed;
+    for(int i = 1; i < numRows; i += 2)
+        utree.removeUser(names[i % names.size()], i % (MAX_DISC + 1), removed);
+    before = numAllocations.load();
+    for(int i = 1; i < numRows; i += 2) {
+        Account acct(names[i % names.size()], i % (MAX_DISC + 1), i % 3 == 0, badge, status);
+        utree.insert(acct);
+    }
+    report("insert_reused", numRows / 2, numAllocations.load() - before);
+}
+
+/* The account and node layout of the original project, every string owning its buffer */
+struct BaselineAccount {
+    string username;
+    int disc;
+    bool nitro;
+    string badge;
+    string status;
+};
+
+struct BaselineDNode {
+    BaselineAccount account;
+    int size;
+    int numVacant;
+    bool vacant;
+    BaselineDNode* left;
+    BaselineDNode* right;
+};
+
+struct BaselineDTree {
+    BaselineDNode* root;
+};
+
+struct BaselineUNode {
+    BaselineDTree* dtree;
+    int height;
+    BaselineUNode* left;
+    BaselineUNode* right;
+};
+
+void Bencher::benchMemory(int numRows) {
+    cout << "layout,accounts,bytes,bytes_per_account" << endl;
+
+    /* A quarter of the accounts carry a badge and a fifth a 16 character status */
+    int numNames = (numRows + MEMORY_BENCH_ACCTS_PER_NAME - 1) / MEMORY_BENCH_ACCTS_PER_NAME;
+    auto username = [](int i) {return "member" + std::to_string(i / MEMORY_BENCH_ACCTS_PER_NAME);};
+    auto badge = [](int i) {return string(i % 4 == 0 ? "Subscriber" : "");};
+    auto status = [](int i) {
+        string digits = std::to_string(10000 + i % 1000);
+        return (i % 5 == 0 ? "away since " + digits : string());
+    };
+    auto report = [numRows](const char* layout, size_t bytes) {
+        cout << layout << "," << numRows << "," << bytes << "," << static_cast<double>(bytes) / numRows << endl;
+    };
+
+    /* The original layout, measured as the bytes its nodes and strings ask the heap for */
+    std::vector<BaselineUNode*> userNodes(numNames, nullptr);
+    std::vector<BaselineDNode*> nodes;
+    nodes.reserve(numRows);
+    long before = numBytesRequested.load();
+    for(int i = 0; i < numRows; i++) {
+        BaselineUNode*& user = userNodes[i / MEMORY_BENCH_ACCTS_PER_NAME];
+        if(user == nullptr)
+            user = new BaselineUNode{new BaselineDTree{nullptr}, 0, nullptr, nullptr};
+        nodes.push_back(new BaselineDNode{{username(i), i % (MAX_DISC + 1), i % 3 == 0, badge(i), status(i)},
+                                          1, 0, false, nullptr, nullptr});
+    }
+    report("baseline", static_cast<size_t>(numBytesRequested.load() - before));
+    for(BaselineDNode* node : nodes)
+        delete node;
+    for(BaselineUNode* user : userNodes) {
+        delete user->dtree;
+        delete user;
+    }
+
+    /* The current layout, its node pools and the strings it added to the shared pools */
+    size_t pooled = StringPool::usernames().getBytesAllocated() + StringPool::statuses().getBytesAllocated();
+    UTree utree;
+    for(int i = 0; i < numRows; i++)
+        utree.emplace(username(i), i % (MAX_DISC + 1), i % 3 == 0, badge(i), status(i));
+    pooled = StringPool::usernames().getBytesAllocated() + StringPool::statuses().getBytesAllocated() - pooled;
+    report("current", utree.stats().bytesAllocated + pooled);
+}
+
+void Bencher::benchBatchLookups(string file, int numRows) {
+    cout << "mode,batch,seconds,lookups_per_sec,hits" << endl;
+
+    UTree utree;
+    utree.loadData(file, true, true);
+
+    /* Random keys over the whole tree so most steps miss the cache once it outgrows the LLC */
+    std::vector<string> names;
+    for(int i = 0; i <= numRows / ACCTS_PER_NAME; i++) names.push_back("user" + std::to_string(i));
+    std::uniform_int_distribution<> distName(0, static_cast<int>(names.size()) - 1);
+    std::vector<UserKey> keys(BATCH_LOOKUPS);
+    for(UserKey& key : keys) key = {names[distName(rng)], distAcct(rng)};
+    std::vector<DNode*> results(keys.size());
+
+    long hits = 0;
+    double seconds = timeSeconds([&]() {
+        for(size_t i = 0; i < keys.size(); i++) results[i] = utree.retrieveUser(keys[i].username, keys[i].disc);
+    });
+    for(DNode* node : results) hits += (node != nullptr);
+    cout << "scalar,1," << seconds << "," << keys.size() / seconds << "," << hits << endl;
+
+    for(int batch : {16, 64, 256, 512}) {
+        seconds = timeSeconds([&]() {
+            for(size_t first = 0; first < keys.size(); first += batch) {
+                int count = static_cast<int>(std::min<size_t>(batch, keys.size() - first));
+                utree.retrieveUserBatch(&keys[first], count, &results[first]);
+            }
+        });
+        hits = 0;
+        for(DNode* node : results) hits += (node != nullptr);
+        cout << "batched," << batch << "," << seconds << "," << keys.size() / seconds << "," << hits << endl;
+    }
+
+#ifdef HAVE_COROUTINE_LOOKUPS
+    for(int width : {1, 16, 64}) {
+        seconds = timeSeconds([&]() {
+            std::vector<Lookup<DNode*>> lookups;
+            lookups.reserve(BATCH_LANES * 64);
+            for(size_t first = 0; first < keys.size(); first += lookups.capacity()) {
+                size_t last = std::min(keys.size(), first + lookups.capacity());
+                LookupScheduler scheduler(width);
+                for(size_t i = first; i < last; i++) {
+                    lookups.push_back(utree.retrieveUserAsync(keys[i].username, keys[i].disc));
+                    scheduler.add(lookups.back());
+                }
+                scheduler.run();
+                for(size_t i = first; i < last; i++) results[i] = lookups[i - first].result();
+                lookups.clear();
+            }
+        });
+        hits = 0;
+        for(DNode* node : results) hits += (node != nullptr);
+        cout << "coroutine," << width << "," << seconds << "," << keys.size() / seconds << "," << hits << endl;
+    }
+#endif
+}
+
+void Bencher::benchSecondaryIndex(string file) {
+    cout << "query,mode,seconds,matches" << endl;
+
+    UTree utree;
+    utree.loadData(file, true, true);
+    double seconds = timeSeconds([&]() { utree.enableIndex(); });
+    const AccountIndex& index = *utree.getIndex();
+    cout << "build,index," << seconds << "," << index.getNumAccounts() << endl;
+    cout << "# index bytes " << index.getBytesAllocated() << endl;
+
+    struct Query {
+        const char* name;
+        std::function<bool(const Account&)> matches;
+        std::function<AccountBitmap()> filter;
+    };
+    std::vector<Query> queries = {
+        {"subscriber_and_nitro",
+         [](const Account& acct) {return acct.getBadge() == "Subscriber" && acct.hasNitro();},
+         [&]() {return index.withBadge("Subscriber") & index.nitro();}},
+        {"has_status",
+         [](const Account& acct) {return !acct.getStatus().empty();},
+         [&]() {return index.hasStatus();}},
+        {"subscriber_not_nitro",
+         [](const Account& acct) {return acct.getBadge() == "Subscriber" && !acct.hasNitro();},
+         [&]() {return index.withBadge("Subscriber") & index.negate(index.nitro());}},
+    };
+
+    /* Both modes visit every matching account, so the index is not credited for skipping that work */
+    for(const Query& query : queries) {
+        long matches = 0;
+        seconds = timeSeconds([&]() {
+            for(UNode* node : utree)
+                for(DNode* account : node->getDTree()->range(MIN_DISC, MAX_DISC))
+                    matches += query.matches(account->getAccount());
+        });
+        cout << query.name << ",scan," << seconds << "," << matches << endl;
+
+        matches = 0;
+        seconds = timeSeconds([&]() {
+            index.forEach(query.filter(), [&matches](const Account& acct) {matches += (acct.getDiscriminator() >= 0);});
+        });
+        cout << query.name << ",index," << seconds << "," << matches << endl;
+    }
+}
+
+void Bencher::benchCopies(string file, int numRows) {
+    cout << "mode,ops,seconds,ns_per_op" << endl;
+    auto report = [](const char* mode, int ops, double seconds) {
+        cout << mode << "," << ops << "," << seconds << "," << seconds * 1e9 / ops << endl;
+    };
+
+    UTree utree;
+    utree.loadData(file, true, true);
+
+    /* What a deep copy costs, every account is collected and rebuilt */
+    UTree deep;
+    double seconds = timeSeconds([&]() {
+        std::vector<Account> accounts;
+        for(UNode* node : utree) node->getDTree()->collectAccounts(accounts);
+        deep.bulkLoad(accounts);
+    });
+    report("deep_copy", 1, seconds);
+
+    seconds = timeSeconds([&]() {
+        for(int i = 0; i < COPY_BENCH_COPIES; i++) {
+            UTree copy(utree);
+        }
+    });
+    report("copy", COPY_BENCH_COPIES, seconds);
+
+    /* The first change to a copy path-copies the UNodes and DNodes it passes */
+    std::uniform_int_distribution<> distName(0, numRows / ACCTS_PER_NAME);
+    std::vector<string> names;
+    for(int i = 0; i < COPY_BENCH_COPIES; i++) names.push_back("user" + std::to_string(distName(rng)));
+    seconds = timeSeconds([&]() {
+        for(int i = 0; i < COPY_BENCH_COPIES; i++) {
+            UTree copy(utree);
+            copy.insert(Account(names[i], utree.allocateDiscriminator(names[i]), false, "", ""));
+        }
+    });
+    report("copy_and_insert", COPY_BENCH_COPIES, seconds);
+
+    /* The same inserts without a copy alive, undone so every one starts from the same tree */
+    Account removed;
+    seconds = timeSeconds([&]() {
+        for(int i = 0; i < COPY_BENCH_COPIES; i++) {
+            int disc = utree.allocateDiscriminator(names[i]);
+            utree.insert(Account(names[i], disc, false, "", ""));
+            utree.removeUser(names[i], disc, removed);
+        }
+    });
+    report("insert_and_remove", COPY_BENCH_COPIES, seconds);
+}
+
+void Bencher::benchJournal(string file, int maxThreads) {
+    string basePath = file + ".base";
+    string journalPath = file + ".journal";
+    auto removeFiles = [&]() {
+        for(const string& path : {basePath, journalPath, journalPath + JOURNAL_NEXT_SUFFIX}) std::remove(path.c_str());
+    };
+
+    /* Sustained logged writes, each thread inserting its own users for a fixed time */
+    cout << "mode,threads,writes,seconds,writes_per_sec,writes_per_sync" << endl;
+    struct Mode {
+        const char* name;
+        JournalSync sync;
+        int groupDelayUs;
+    };
+    for(const Mode& mode : {Mode{"sync_each", SYNC_EACH, 0}, Mode{"sync_group", SYNC_GROUP, 0},
+                            Mode{"sync_group_delayed", SYNC_GROUP, JOURNAL_BENCH_DELAY_US}}) {
+        for(int numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+            removeFiles();
+            JournalOptions options;
+            options.sync = mode.sync;
+            options.groupDelayUs = mode.groupDelayUs;
+            DurableUTree durable;
+            durable.open(basePath, journalPath, options);
+
+            std::atomic<bool> stop(false);
+            std::atomic<long> writes(0);
+            std::vector<std::thread> writers;
+            double seconds = timeSeconds([&]() {
+                for(int t = 0; t < numThreads; t++) {
+                    writers.emplace_back([&, t]() {
+                        long mine = 0;
+                        for(; !stop.load(std::memory_order_relaxed); mine++) {
+                            durable.insert(Account("writer" + std::to_string(t) + "_" + std::to_string(mine / 10000),
+                                                   mine % 10000, false, "", ""));
+                        }
+                        writes += mine;
+                    });
+                }
+                std::this_thread::sleep_for(std::chrono::duration<double>(JOURNAL_BENCH_SECONDS));
+                stop = true;
+                for(std::thread& writer : writers) writer.join();
+            });
+            cout << mode.name << "," << numThreads << "," << writes << "," << seconds << "," << writes / seconds << ","
+                 << static_cast<double>(writes) / std::max<uint64_t>(1, durable.getNumSyncs()) << endl;
+        }
+    }
+
+    /* Replay of a journal holding every account, then folding it into a base */
+    cout << "mode,records,seconds,records_per_sec" << endl;
+    removeFiles();
+    UTree source;
+    source.loadData(file, true, true);
+    std::vector<Account> accounts;
+    for(UNode* node : source) node->getDTree()->collectAccounts(accounts);
+    {
+        Journal journal;
+        journal.open(journalPath);
+        for(const Account& acct : accounts) journal.append(JOURNAL_INSERT, acct);
+        journal.close();
+    }
+
+    DurableUTree durable;
+    double seconds = timeSeconds([&]() { durable.open(basePath, journalPath); });
+    cout << "journal_replay," << durable.getNumReplayed() << "," << seconds << "," << durable.getNumReplayed() / seconds << endl;
+    seconds = timeSeconds([&]() { durable.compact(); });
+    cout << "journal_compact," << accounts.size() << "," << seconds << "," << accounts.size() / seconds << endl;
+    durable.close();
+    seconds = timeSeconds([&]() { durable.open(basePath, journalPath); });
+    cout << "base_open," << accounts.size() << "," << seconds << "," << accounts.size() / seconds << endl;
+    durable.close();
+    removeFiles();
+}
+
+Bencher::Workload Bencher::makeWorkload(const string& name, int numRows) {
+    Workload workload;
+    workload.name = name;
+    int numNames = std::max(1, numRows / ACCTS_PER_NAME);
+    std::uniform_int_distribution<> distName(0, numNames - 1);
+
+    /* Zipf ranks are drawn from the cumulative weights 1/rank^s, so a few names get most accounts */
+    std::vector<double> zipf;
+    if(name == "zipf") {
+        zipf.resize(numNames);
+        double total = 0;
+        for(int r = 0; r < numNames; r++) zipf[r] = (total += 1.0 / std::pow(r + 1, ZIPF_SKEW));
+    }
+    std::uniform_real_distribution<> distUnit(0.0, 1.0);
+
+    std::vector<std::pair<int, int>> keys(numRows);
+    for(std::pair<int, int>& key : keys) {
+        if(name == "zipf")
+            key.first = static_cast<int>(std::lower_bound(zipf.begin(), zipf.end(), distUnit(rng) * zipf.back()) - zipf.begin());
+        else
+            key.first = distName(rng);
+        key.second = distAcct(rng);
+    }
+
+    /* Names are zero padded so numeric order and string order agree */
+    auto username = [](int id) {
+        string digits = std::to_string(id);
+        return "user" + string(8 - std::min<size_t>(8, digits.size()), '0') + digits;
+    };
+    if(name == "sorted" || name == "reverse") {
+        std::sort(keys.begin(), keys.end());
+        if(name == "reverse") std::reverse(keys.begin(), keys.end());
+    }
+    for(const std::pair<int, int>& key : keys) {
+        workload.usernames.push_back(username(key.first));
+        workload.discs.push_back(key.second);
+    }
+    return workload;
+}
+
+void Bencher::writeWorkload(const Workload& workload, const string& file) {
+    std::ofstream out(file);
+    for(size_t i = 0; i < workload.usernames.size(); i++)
+        out << workload.usernames[i] << "," << workload.discs[i] << "," << (i % 3 == 0) << ","
+            << (i % 4 == 0 ? "Subscriber" : "") << "," << (i % 5 == 0 ? "This is a status" : "") << "\n";
+}
+
+template <class Op>
+double Bencher::timeEach(int count, Op op, std::vector<long>& latencies) {
+    latencies.resize(count);
+    auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    for(int i = 0; i < count; i++) {
+        op(i);
+        auto now = std::chrono::steady_clock::now();
+        latencies[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+        last = now;
+    }
+    std::chrono::duration<double> elapsed = last - start;
+    return elapsed.count();
+}
+
+void Bencher::report(std::ostream& out, const string& label, const Workload& workload, const string& op,
+                     double seconds, std::vector<long>& latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    out << label << "," << workload.name << "," << workload.usernames.size() << "," << op << ","
+        << latencies.size() << "," << seconds << "," << latencies.size() / seconds << ","
+        << percentile(0.50) << "," << percentile(0.99) << endl;
+}
+
+void Bencher::runSuite(int maxRows, string outFile, string label) {
+    std::ofstream out(outFile);
+    out << "build,workload,rows,op,ops,seconds,ops_per_sec,p50_ns,p99_ns" << endl;
+    string csvFile = outFile + ".accounts.csv";
+
+    for(int numRows = SUITE_MIN_ROWS; numRows <= maxRows; numRows *= 10) {
+        for(const char* name : {"uniform", "sorted", "reverse", "zipf"}) {
+            Workload workload = makeWorkload(name, numRows);
+            const std::vector<string>& usernames = workload.usernames;
+            const std::vector<int>& discs = workload.discs;
+            std::vector<long> latencies;
+            std::cerr << name << " " << numRows << endl;
+
+            UTree utree;
+            double seconds = timeEach(numRows, [&](int i) {
+                utree.emplace(usernames[i], discs[i], i % 3 == 0, "", "");
+            }, latencies);
+            report(out, label, workload, "insert", seconds, latencies);
+
+            /* Results feed a volatile so the lookups cannot be optimized away */
+            volatile long hits = 0;
+            seconds = timeEach(numRows, [&](int i) {hits = hits + (utree.retrieve(usernames[i]) != nullptr);}, latencies);
+            report(out, label, workload, "retrieve", seconds, latencies);
+
+            seconds = timeEach(numRows, [&](int i) {
+                hits = hits + (utree.retrieveUser(usernames[i], discs[i]) != nullptr);
+            }, latencies);
+            report(out, label, workload, "retrieveUser", seconds, latencies);
+
+            Account removed;
+            seconds = timeEach(numRows, [&](int i) {utree.removeUser(usernames[i], discs[i], removed);}, latencies);
+            report(out, label, workload, "remove", seconds, latencies);
+
+            /* Whole-file loads, the percentiles are over runs */
+            writeWorkload(workload, csvFile);
+            for(int bulk = 0; bulk <= 1; bulk++) {
+                latencies.clear();
+                seconds = 0;
+                for(int run = 0; run < SUITE_LOAD_RUNS; run++) {
+                    UTree loaded;
+                    double runSeconds = timeSeconds([&]() {loaded.loadData(csvFile, true, bulk);});
+                    latencies.push_back(static_cast<long>(runSeconds * 1e9));
+                    seconds += runSeconds;
+                }
+                out << label << "," << workload.name << "," << numRows << "," << (bulk ? "loadData_bulk" : "loadData")
+                    << "," << static_cast<long>(numRows) * SUITE_LOAD_RUNS << "," << seconds << ","
+                    << numRows * SUITE_LOAD_RUNS / seconds << ",";
+                std::sort(latencies.begin(), latencies.end());
+                out << latencies[SUITE_LOAD_RUNS / 2] << "," << latencies.back() << endl;
+            }
+        }
+    }
+    std::remove(csvFile.c_str());
+}
+
+template <class Job>
+double Bencher::timeSeconds(Job job) {
+    auto start = std::chrono::steady_clock::now();
+    job();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(int argc, char** argv) {
+    Bencher bencher;
+
+    /* bench --suite [maxRows] [results.csv] [build label] */
+    if(argc > 1 && string(argv[1]) == "--suite") {
+        int maxRows = (argc > 2 ? std::atoi(argv[2]) : SUITE_MAX_ROWS);
+        string outFile = (argc > 3 ? argv[3] : SUITE_FILE);
+        string label = (argc > 4 ? argv[4] : "current");
+        bencher.runSuite(maxRows, outFile, label);
+        return 0;
+    }
+
+    int numRows = (argc > 1 ? std::atoi(argv[1]) : NUMROWS);
+    int maxThreads = (argc > 2 ? std::atoi(argv[2]) : static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+
+    bencher.writeAccounts(BENCH_FILE, numRows);
+    bencher.benchLoadScaling(BENCH_FILE, numRows, maxThreads);
+    bencher.benchReadScaling(BENCH_FILE, maxThreads);
+    bencher.benchSnapshot(BENCH_FILE, numRows);
+    bencher.benchBatchLookups(BENCH_FILE, numRows);
+    bencher.benchSecondaryIndex(BENCH_FILE);
+    bencher.benchCopies(BENCH_FILE, numRows);
+    bencher.benchJournal(BENCH_FILE, maxThreads);
+    bencher.benchAllocations(std::min(numRows, ALLOC_BENCH_ROWS));
+    bencher.benchMemory(std::min(numRows, MEMORY_BENCH_ROWS));
+    std::remove(BENCH_FILE);
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * ConcurrentUTree.cpp
+ * Implementation for the ConcurrentUTree class.
+ */
+
+#include "cutree.h"
+
+/**
+ * Retrieves a copy of the account with a matching username and discriminator.
+ * @param username username to match
+ * @param disc discriminator to match
+ * @param found Account object to hold the matching account
+ * @return true if a matching account was found, false otherwise
+ */
+bool ConcurrentUTree::retrieveUser(std::string_view username, int disc, Account& found) const {
+  return read([&](UTree& utree) {
+    DNode* node = utree.retrieveUser(username, disc);
+    if(node == nullptr)
+      return false;
+    found = node->getAccount(); //accounts only hold pooled strings, so the copy outlives the read
+    return true;
+  });
+}
+
+/**
+ * Returns the number of users with a specific username.
+ * @param username username to match
+ * @return number of users with the specified username
+ */
+int ConcurrentUTree::numUsers(std::string_view username) const {
+  return read([&](UTree& utree) {
+    return utree.numUsers(username);
+  });
+}
+
+/**
+ * Inserts an account into both copies of the tree.
+ * @param newAcct Account object to insert
+ * @return true if the account was inserted, false otherwise
+ */
+bool ConcurrentUTree::insert(const Account& newAcct) {
+  return write([&](UTree& utree) {
+    return utree.insert(newAcct);
+  });
+}
+
+/**
+ * Removes a user with a matching username and discriminator from both copies of the tree.
+ * @param username username to match
+ * @param disc discriminator to match
+ * @param removed Account object to hold the removed account
+ * @return true if an account was removed, false otherwise
+ */
+bool ConcurrentUTree::removeUser(std::string_view username, int disc, Account& removed) {
+  return write([&](UTree& utree) {
+    return utree.removeUser(username, disc, removed);
+  });
+}
+
+/**
+ * Sources a .csv file into one copy of the tree, then makes the other copy share it.
+ * The file is parsed once, so both copies hold the same accounts even if it changes.
+ * @param infile path to .csv file containing database of accounts
+ * @param append true to append to the existing accounts or false to clear before importing
+ */
+void ConcurrentUTree::loadData(const string& infile, bool append) {
+  const UTree* loaded = nullptr;
+  write([&](UTree& utree) {
+    if(loaded == nullptr) {
+      utree.loadData(infile, append, true);
+      loaded = &utree;
+      return;
+    }
+
+    //an O(1) copy that shares every node, copies start without indexes so they are rebuilt
+    bool indexed = (utree.getIndex() != nullptr);
+    utree = *loaded;
+    if(indexed)
+      utree.enableIndex();
+  });
+}
+
+void ConcurrentUTree::publish(int updated){
+  //new readers go to the updated copy from here on
+  _readIndex.store(updated, std::memory_order_seq_cst);
+
+  //flip the indicator new readers arrive on and wait for both to drain,
+  //after which no reader can still be inside the stale copy
+  int version = _versionIndex.load(std::memory_order_relaxed);
+  int next = 1 - version;
+  while(!_readers[next].isEmpty())
+    std::this_thread::yield();
+  _versionIndex.store(next, std::memory_order_seq_cst);
+  while(!_readers[version].isEmpty())
+    std::this_thread::yield();
+}
@@ -0,0 +1,127 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * ConcurrentUTree.h
+ * A UTree that many threads can read while one thread writes.
+ */
+
+#pragma once
+
+#include "utree.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+#define NUM_READER_SLOTS 64
+
+/**
+ * Counts the readers inside one version of the tree. Readers spread over
+ * cache line sized slots so arriving and departing threads do not contend.
+ */
+class ReaderIndicator {
+public:
+    ReaderIndicator() {
+        for(Slot& slot : _slots) slot.count.store(0, std::memory_order_relaxed);
+    }
+
+    void arrive() {_slots[slotIndex()].count.fetch_add(1, std::memory_order_seq_cst);}
+    void depart() {_slots[slotIndex()].count.fetch_sub(1, std::memory_order_release);}
+
+    bool isEmpty() const {
+        for(const Slot& slot : _slots)
+            if(slot.count.load(std::memory_order_acquire) != 0) return false;
+        return true;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<long> count;
+    };
+
+    Slot _slots[NUM_READER_SLOTS];
+
+    static int slotIndex() {
+        static thread_local int index = static_cast<int>(
+            std::hash<std::thread::id>()(std::this_thread::get_id()) % NUM_READER_SLOTS);
+        return index;
+    }
+};
+
+/**
+ * Left-Right wrapper around two identical UTrees. Readers never block and
+ * always see a tree that no writer is touching. The single writer applies
+ * every mutation to the idle copy, flips readers onto it, waits for the
+ * readers still on the old copy to leave, then repeats the mutation there.
+ * Nodes freed by a mutation are only ever freed in a copy with no readers,
+ * so no separate reclamation scheme is needed.
+ */
+class ConcurrentUTree {
+public:
+    ConcurrentUTree(): _readIndex(0), _versionIndex(0) {}
+
+    ConcurrentUTree(const ConcurrentUTree&) = delete;
+    ConcurrentUTree& operator=(const ConcurrentUTree&) = delete;
+
+    /* Readers, safe from any number of threads */
+
+    bool retrieveUser(std::string_view username, int disc, Account& found) const;
+    int numUsers(std::string_view username) const;
+
+    /**
+     * Runs a read-only function against a consistent version of the tree.
+     * Pointers into the tree must not escape the function.
+     * @param reader callable taking a UTree&, it must not modify the tree
+     * @return whatever reader returns
+     */
+    template <class Reader>
+    auto read(Reader reader) const -> decltype(reader(std::declval<UTree&>())) {
+        int version = _versionIndex.load(std::memory_order_seq_cst);
+        ReaderGuard guard(_readers[version]);
+        return reader(_trees[_readIndex.load(std::memory_order_seq_cst)]);
+    }
+
+    /* Writers, serialized against each other */
+
+    bool insert(const Account& newAcct);
+    bool removeUser(std::string_view username, int disc, Account& removed);
+    void loadData(const string& infile, bool append = true);
+
+    /**
+     * Applies a mutation to both copies of the tree. The mutation must be
+     * deterministic so both copies stay identical.
+     * @param writer callable taking a UTree&
+     * @return whatever writer returned for the first copy
+     */
+    template <class Writer>
+    auto write(Writer writer) -> decltype(writer(std::declval<UTree&>())) {
+        std::lock_guard<std::mutex> guard(_writerLock);
+
+        int idle = 1 - _readIndex.load(std::memory_order_relaxed);
+        if constexpr (std::is_void<decltype(writer(std::declval<UTree&>()))>::value) {
+            writer(_trees[idle]);
+            publish(idle);
+            writer(_trees[1 - idle]);
+        } else {
+            auto result = writer(_trees[idle]);
+            publish(idle);
+            writer(_trees[1 - idle]);
+            return result;
+        }
+    }
+
+private:
+    mutable UTree _trees[2];
+    std::atomic<int> _readIndex;    /* Copy new readers are sent to */
+    std::atomic<int> _versionIndex; /* Indicator new readers arrive on */
+    mutable ReaderIndicator _readers[2];
+    std::mutex _writerLock;
+
+    struct ReaderGuard {
+        ReaderIndicator& indicator;
+        explicit ReaderGuard(ReaderIndicator& readers): indicator(readers) {indicator.arrive();}
+        ~ReaderGuard() {indicator.depart();}
+    };
+
+    void publish(int updated);
+};
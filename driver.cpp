@@ -2,7 +2,19 @@
 #include "utree.cpp"
 #include "dtree.h"
 #include "dtree.cpp"
+#include "strpool.cpp"
+#include "acctindex.cpp"
+#include "treestats.cpp"
+#include "cutree.h"
+#include "cutree.cpp"
+#include "journal.h"
+#include "journal.cpp"
+#include "dutree.h"
+#include "dutree.cpp"
 #include <random>
+#include <algorithm>
+#include <functional>
+#include <sstream>
 
 #define NUMACCTS 20
 #define RANDDISC (distAcct(rng))
@@ -15,32 +27,1490 @@ public:
     bool testBasicDTreeInsert(DTree& dtree);
 
     bool testBasicUTreeInsert(UTree& utree);
+
+    bool testOrderStatistics(DTree& dtree);
+
+    bool testDTreeRemove(DTree& dtree);
+
+    bool testTryInsert(DTree& dtree);
+
+    bool testCompactThreshold(DTree& dtree);
+
+    bool testAggregates(DTree& dtree);
+
+    bool testDTreeCopy(DTree& dtree);
+
+    bool testNodePool(NodePool<DNode>& pool);
+
+    bool testUTreeBalance(UTree& utree);
+
+    bool testUTreeRemove(UTree& utree);
+
+    bool testEmplace(UTree& utree);
+
+    bool testScans(UTree& utree);
+
+    bool testAllocateDiscriminator(UTree& utree);
+
+    bool testSecondaryIndex(UTree& utree);
+
+    bool testManyBadges(UTree& utree);
+
+    bool testStats(UTree& utree);
+
+    bool testBulkLoad(UTree& utree);
+
+    bool testBatchRetrieve(UTree& utree);
+
+#ifdef HAVE_COROUTINE_LOOKUPS
+    bool testCoroutineLookups(UTree& utree);
+#endif
+
+    bool testParallelLoad(UTree& utree);
+
+    bool testMalformedLines(UTree& utree);
+
+    bool testConcurrentReads(ConcurrentUTree& ctree);
+
+    bool testSnapshot(UTree& utree);
+
+    bool testUTreeCopy(UTree& utree);
+
+    bool testJournal(DurableUTree& durable);
+
+    bool testInterruptedImport(DurableUTree& durable);
+
+    bool testDurableBase(DurableUTree& durable);
+
+private:
+    bool isAVL(UNode* node);
+
+    bool hasValidCounts(DNode* node);
 };
 
-bool Tester::testBasicDTreeInsert(DTree& dtree) {
-    bool allInserted = true;
-    for(int i = 0; i < NUMACCTS; i++) {
-        int disc = RANDDISC;
-        Account newAcct = Account("", disc, 0, "", "");
-        if(!dtree.insert(newAcct)) {
-            cout << "Insertion on node " << disc << " did not return true" << endl;
-            allInserted = false;
+bool Tester::testBasicDTreeInsert(DTree& dtree) {
+    bool allInserted = true;
+    for(int i = 0; i < NUMACCTS; i++) {
+        int disc = RANDDISC;
+        Account newAcct = Account("", disc, 0, "", "");
+        if(!dtree.insert(newAcct)) {
+            cout << "Insertion on node " << disc << " did not return true" << endl;
+            allInserted = false;
+        }
+    }
+    return allInserted;
+}
+
+bool Tester::testAggregates(DTree& dtree) {
+    /* Churn accounts with mixed nitro and badges, checking the counters against a model */
+    const char* badges[] = {"", "Subscriber", "Moderator", "Partner"};
+    std::vector<int> model(MAX_DISC + 1, -1);   /* badge index * 2 + nitro, -1 if not live */
+    Account removed;
+    for(int i = 0; i < NUMACCTS * 400; i++) {
+        int disc = RANDDISC % 1000;
+        if(i % 3 == 2) {
+            dtree.remove(disc, removed);
+            model[disc] = -1;
+        } else if(model[disc] < 0) {
+            int kind = distAcct(rng) % 8;
+            dtree.insert(Account("", disc, kind % 2, badges[kind / 2], ""));
+            model[disc] = kind;
+        }
+
+        if(i % 97 == 0 || i == NUMACCTS * 400 - 1) {
+            int lo = RANDDISC % 1000, hi = lo + RANDDISC % 300;
+            int nitro = 0, nitroInRange = 0, partners = 0, partnersInRange = 0;
+            for(int d = 0; d < 1000; d++) {
+                if(model[d] < 0) continue;
+                nitro += model[d] % 2;
+                partners += (model[d] / 2 == 3);
+                if(d >= lo && d <= hi) {
+                    nitroInRange += model[d] % 2;
+                    partnersInRange += (model[d] / 2 == 3);
+                }
+            }
+            if(dtree.getNumNitro() != nitro || dtree.numNitroInRange(lo, hi) != nitroInRange ||
+               dtree.getNumWithBadge("Partner") != partners ||
+               dtree.numWithBadgeInRange("Partner", lo, hi) != partnersInRange || !hasValidCounts(dtree._root)) {
+                cout << "Counters disagree with the model after " << i << " operations" << endl;
+                return false;
+            }
+        }
+    }
+    int total = 0;
+    for(const char* badge : badges) total += dtree.getNumWithBadge(badge);
+    return total == dtree.getNumUsers() && dtree.getNumWithBadge("Unseen badge") == 0 && dtree.getNumCompactions() > 0;
+}
+
+bool Tester::testBasicUTreeInsert(UTree& utree) {
+    string dataFile = "accounts.csv";
+    try {
+        utree.loadData(dataFile);
+    } catch(std::invalid_argument e) {
+        std::cerr << e.what() << endl;
+        return false;
+    }
+    return true;
+}
+
+bool Tester::testOrderStatistics(DTree& dtree) {
+    for(int i = 0; i < NUMACCTS * 10; i++) {
+        dtree.insert(Account("", RANDDISC, 0, "", ""));
+    }
+    Account removed;
+    for(int i = 0; i < NUMACCTS; i++) {
+        dtree.remove(dtree.select(i * 3)->getDiscriminator(), removed);
+    }
+
+    /* Compare against the live accounts in discriminator order */
+    std::vector<Account> live;
+    dtree.collectAccounts(live);
+    for(int k = 0; k < static_cast<int>(live.size()); k++) {
+        if(dtree.select(k) == nullptr || dtree.select(k)->getDiscriminator() != live[k].getDiscriminator() ||
+           dtree.rank(live[k].getDiscriminator()) != k) {
+            cout << "select/rank mismatch at position " << k << endl;
+            return false;
+        }
+    }
+    if(dtree.select(static_cast<int>(live.size())) != nullptr) {
+        cout << "select past the last account returned a node" << endl;
+        return false;
+    }
+    for(int i = 0; i < NUMACCTS; i++) {
+        int lo = RANDDISC;
+        int hi = lo + RANDDISC / 4;
+        std::vector<int> expected;
+        for(const Account& acct : live) {
+            if(acct.getDiscriminator() >= lo && acct.getDiscriminator() <= hi) {
+                expected.push_back(acct.getDiscriminator());
+            }
+        }
+        std::vector<int> actual;
+        for(DNode* node : dtree.range(lo, hi)) {
+            actual.push_back(node->getDiscriminator());
+        }
+        if(actual != expected || dtree.countInRange(lo, hi) != static_cast<int>(expected.size())) {
+            cout << "range [" << lo << ", " << hi << "] mismatch" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Tester::testDTreeRemove(DTree& dtree) {
+    std::vector<int> discs;
+    for(int i = 0; i < NUMACCTS * 25; i++) {
+        int disc = RANDDISC;
+        if(dtree.insert(Account("", disc, 0, "", ""))) {
+            discs.push_back(disc);
+        }
+    }
+    std::shuffle(discs.begin(), discs.end(), rng);
+
+    /* Removed accounts belong to the caller, so one held from an earlier removal survives the next */
+    Account held[2];
+    Account removed;
+    int remaining = static_cast<int>(discs.size());
+    for(size_t i = 0; i < discs.size(); i++) {
+        int disc = discs[i];
+        if(!dtree.remove(disc, held[i % 2]) || held[i % 2].getDiscriminator() != disc || dtree.retrieve(disc) != nullptr) {
+            cout << "Removal of " << disc << " failed" << endl;
+            return false;
+        }
+        if(i > 0 && held[(i + 1) % 2].getDiscriminator() != discs[i - 1]) {
+            cout << "Removing " << disc << " changed the account removed before it" << endl;
+            return false;
+        }
+        remaining--;
+        if(dtree.remove(disc, removed) || dtree.getNumUsers() != remaining || !hasValidCounts(dtree._root)) {
+            cout << "Tree is inconsistent after removing " << disc << endl;
+            return false;
+        }
+    }
+    return dtree.getNumCompactions() > 0;
+}
+
+bool Tester::testTryInsert(DTree& dtree) {
+    /* Churn inserts and removes so vacant nodes get reused, checking against a model */
+    std::vector<bool> live(MAX_DISC + 1, false);
+    Account removed;
+    for(int i = 0; i < NUMACCTS * 250; i++) {
+        int disc = RANDDISC % 500;
+        if(i % 3 == 2) {
+            if(dtree.remove(disc, removed) != live[disc]) {
+                cout << "remove(" << disc << ") disagrees with the model" << endl;
+                return false;
+            }
+            live[disc] = false;
+        } else {
+            std::pair<DNode*, bool> result = dtree.tryInsert(Account("", disc, 0, "", ""));
+            if(result.second == live[disc] || result.first == nullptr || result.first->getDiscriminator() != disc) {
+                cout << "tryInsert(" << disc << ") returned the wrong node or flag" << endl;
+                return false;
+            }
+            live[disc] = true;
+        }
+    }
+
+    std::vector<Account> accounts;
+    dtree.collectAccounts(accounts);
+    size_t index = 0;
+    for(int disc = 0; disc <= MAX_DISC; disc++) {
+        if(live[disc] != (dtree.retrieve(disc) != nullptr)) {
+            cout << "retrieve(" << disc << ") disagrees with the model" << endl;
+            return false;
+        }
+        if(live[disc] && (index >= accounts.size() || accounts[index++].getDiscriminator() != disc)) {
+            cout << "Tree is out of order at " << disc << endl;
+            return false;
+        }
+    }
+    return index == accounts.size() && hasValidCounts(dtree._root);
+}
+
+bool Tester::testCompactThreshold(DTree& dtree) {
+    /* Thresholds are per tree, one that compacts eagerly and one that never does */
+    DTree never;
+    dtree.setCompactThreshold(0.0);
+    never.setCompactThreshold(1.0);
+    if(dtree.getCompactThreshold() != 0.0 || never.getCompactThreshold() != 1.0 || DTree().getCompactThreshold() != DEFAULT_COMPACT_THRESHOLD) {
+        cout << "Setting one tree's threshold changed another" << endl;
+        return false;
+    }
+
+    std::vector<int> discs;
+    for(int i = 0; i < NUMACCTS * 25; i++) {
+        int disc = RANDDISC;
+        if(dtree.insert(Account("", disc, 0, "", ""))) {
+            never.insert(Account("", disc, 0, "", ""));
+            discs.push_back(disc);
+        }
+    }
+    std::shuffle(discs.begin(), discs.end(), rng);
+
+    Account removed;
+    for(size_t i = 0; i < discs.size() / 2; i++) {
+        if(!dtree.remove(discs[i], removed) || !never.remove(discs[i], removed)) {
+            cout << "Removal of " << discs[i] << " failed" << endl;
+            return false;
+        }
+        /* A zero threshold rebuilds every subtree that gains a vacant node */
+        if(dtree._root->getNumVacant() != 0 || !hasValidCounts(dtree._root) || !hasValidCounts(never._root)) {
+            cout << "Tree is inconsistent after removing " << discs[i] << endl;
+            return false;
+        }
+    }
+
+    /* Copies keep the threshold of their source */
+    DTree copy(dtree);
+    int remaining = static_cast<int>(discs.size() - discs.size() / 2);
+    return dtree.getNumCompactions() > 0 && never.getNumCompactions() == 0 && never._root->getNumVacant() > 0
+           && dtree.getNumUsers() == remaining && never.getNumUsers() == remaining
+           && copy.getCompactThreshold() == 0.0;
+}
+
+bool Tester::testNodePool(NodePool<DNode>& pool) {
+    /* Destroyed slots are handed out again, most recent first, without a new slab */
+    std::vector<DNode*> nodes;
+    for(int i = 0; i < NUMACCTS; i++) {
+        nodes.push_back(pool.create(Account("pooled", i, 0, "", "")));
+    }
+    size_t bytes = pool.getBytesAllocated();
+    if(pool.getNumLive() != NUMACCTS || bytes == 0) {
+        cout << "Pool counted " << pool.getNumLive() << " live nodes" << endl;
+        return false;
+    }
+    for(int i : {3, 7, 11}) {
+        pool.destroy(nodes[i]);
+    }
+    if(pool.getNumLive() != NUMACCTS - 3) {
+        return false;
+    }
+    for(int i : {11, 7, 3}) {
+        DNode* reused = pool.create(Account("reused", i, 0, "", ""));
+        if(reused != nodes[i]) {
+            cout << "Freed slot " << i << " was not reused" << endl;
+            return false;
+        }
+    }
+    if(pool.getNumLive() != NUMACCTS || pool.getBytesAllocated() != bytes ||
+       nodes[4]->getDiscriminator() != 4 || nodes[7]->getUsername() != "reused") {
+        cout << "Reuse disturbed the other nodes" << endl;
+        return false;
+    }
+
+    /* A released pool is empty and can be used again */
+    pool.release();
+    if(pool.getNumLive() != 0 || pool.getBytesAllocated() != 0) {
+        cout << "Release kept " << pool.getBytesAllocated() << " bytes" << endl;
+        return false;
+    }
+    DNode* fresh = pool.create(Account("fresh", 1, 0, "", ""));
+    if(pool.getNumLive() != 1 || fresh->getDiscriminator() != 1) {
+        return false;
+    }
+    pool.release();
+
+    /* Adopting into an empty pool takes the nodes and the free list as they are */
+    NodePool<DNode> donor;
+    std::vector<DNode*> donated;
+    for(int i = 0; i < 5; i++) {
+        donated.push_back(donor.create(Account("donated", i, 0, "", "")));
+    }
+    donor.destroy(donated[2]);
+    size_t donorBytes = donor.getBytesAllocated();
+    pool.adopt(donor);
+    if(pool.getNumLive() != 4 || pool.getBytesAllocated() != donorBytes ||
+       donor.getNumLive() != 0 || donor.getBytesAllocated() != 0 || donated[4]->getDiscriminator() != 4) {
+        cout << "Adopting into an empty pool lost nodes" << endl;
+        return false;
+    }
+    if(pool.create(Account("adopted", 2, 0, "", "")) != donated[2]) {
+        cout << "Adopted free slot was not reused" << endl;
+        return false;
+    }
+
+    /* Adopting into a pool in use merges both free lists and keeps filling the current slab */
+    for(int i = 0; i < 6; i++) {
+        donated.push_back(donor.create(Account("donated", 10 + i, 0, "", "")));
+    }
+    donor.destroy(donated[6]);
+    donor.destroy(donated[8]);
+    pool.destroy(donated[0]);
+    size_t totalBytes = pool.getBytesAllocated() + donor.getBytesAllocated();
+    pool.adopt(donor);
+    if(pool.getNumLive() != 4 + 4 || pool.getBytesAllocated() != totalBytes || donor.getNumLive() != 0) {
+        cout << "Adopting into a pool in use counted " << pool.getNumLive() << " live nodes" << endl;
+        return false;
+    }
+    std::vector<DNode*> freed = {donated[0], donated[6], donated[8]};
+    for(int i = 0; i < 3; i++) {
+        DNode* reused = pool.create(Account("merged", i, 0, "", ""));
+        if(std::find(freed.begin(), freed.end(), reused) == freed.end()) {
+            cout << "Merged free list was not reused" << endl;
+            return false;
+        }
+        freed.erase(std::find(freed.begin(), freed.end(), reused));
+    }
+    return pool.getNumLive() == 11 && pool.getBytesAllocated() == totalBytes && donated[10]->getDiscriminator() == 15;
+}
+
+bool Tester::testDTreeCopy(DTree& dtree) {
+    /* Even discriminators in a perfectly balanced tree, an odd one then lands in a leaf without a rebalance */
+    std::vector<Account> accounts;
+    for(int disc = 0; disc < 2 * 1023; disc += 2) {
+        accounts.push_back(Account("copy", disc, disc % 3 == 0, (disc % 5 == 0 ? "Subscriber" : ""), ""));
+    }
+    dtree.bulkLoad(accounts.data(), static_cast<int>(accounts.size()));
+    size_t numNodes = accounts.size();
+    size_t height = dtree.stats().height;
+
+    std::vector<bool> inOriginal(MAX_DISC + 1, false);
+    for(const Account& acct : accounts) {
+        inOriginal[acct.getDiscriminator()] = true;
+    }
+    {
+        DTree copy(dtree);
+        if(copy._root != dtree._root || dtree._pool.getNumLive() != numNodes) {
+            cout << "Copy did not share the nodes" << endl;
+            return false;
+        }
+
+        /* The first change copies the path down to the new leaf and nothing else */
+        copy.insert(Account("copy", 1, 1, "", ""));
+        if(dtree._pool.getNumLive() != numNodes + height + 1 || dtree.retrieve(1) != nullptr || copy.retrieve(1) == nullptr) {
+            cout << "Insert into the copy made " << dtree._pool.getNumLive() - numNodes << " nodes" << endl;
+            return false;
+        }
+
+        /* Churn both trees and a copy of a copy, each must only see its own changes */
+        std::vector<bool> inCopy(inOriginal);
+        inCopy[1] = true;
+        DTree nested;
+        std::vector<bool> inNested;
+        Account removed;
+        for(int i = 0; i < NUMACCTS * 200; i++) {
+            if(i == NUMACCTS * 100) {
+                nested = copy;
+                inNested = inCopy;
+            }
+            DTree& target = (i % 2 == 0 ? dtree : copy);
+            std::vector<bool>& model = (i % 2 == 0 ? inOriginal : inCopy);
+            int disc = RANDDISC % 3000;
+            if(i % 3 == 0) {
+                if(target.remove(disc, removed) != model[disc]) {
+                    cout << "remove(" << disc << ") disagrees with the model" << endl;
+                    return false;
+                }
+                model[disc] = false;
+            } else {
+                if(target.insert(Account("copy", disc, 0, "", "")) == model[disc]) {
+                    cout << "insert(" << disc << ") disagrees with the model" << endl;
+                    return false;
+                }
+                model[disc] = true;
+            }
+        }
+
+        for(int disc = 0; disc <= MAX_DISC; disc++) {
+            if(inOriginal[disc] != (dtree.retrieve(disc) != nullptr) || inCopy[disc] != (copy.retrieve(disc) != nullptr) ||
+               inNested[disc] != (nested.retrieve(disc) != nullptr)) {
+                cout << "A copy sees another tree's change at " << disc << endl;
+                return false;
+            }
+        }
+        if(!hasValidCounts(dtree._root) || !hasValidCounts(copy._root) || !hasValidCounts(nested._root)) {
+            return false;
+        }
+    }
+
+    /* Once the copies are gone the pool holds exactly the original's nodes */
+    DTreeStats stats = dtree.stats();
+    if(dtree._pool.getNumLive() != static_cast<size_t>(stats.numNodes) || dtree._pool.isShared()) {
+        cout << "Nodes of the dropped copies were not given back" << endl;
+        return false;
+    }
+    return hasValidCounts(dtree._root);
+}
+
+bool Tester::testUTreeBalance(UTree& utree) {
+    /* Usernames arrive in sorted order, the worst case for an unbalanced BST */
+    for(int i = 0; i < NUMACCTS * 10; i++) {
+        string username = "user" + std::to_string(1000 + i);
+        if(!utree.insert(Account(username, RANDDISC, 0, "", ""))) {
+            cout << "Insertion of " << username << " did not return true" << endl;
+            return false;
+        }
+    }
+    return isAVL(utree._root) && utree._root->getHeight() <= 8;
+}
+
+bool Tester::testUTreeRemove(UTree& utree) {
+    Account removed;
+    for(int i = 0; i < NUMACCTS * 10; i += 2) {
+        string username = "user" + std::to_string(1000 + i);
+        int disc = utree.retrieve(username)->getDTree()->_root->getDiscriminator();
+        if(!utree.removeUser(username, disc, removed) || removed.getDiscriminator() != disc) {
+            cout << "Removal of " << username << "#" << disc << " failed" << endl;
+            return false;
+        }
+        if(utree.retrieve(username) != nullptr || utree.removeUser(username, disc, removed)) {
+            cout << username << " is still in the tree after removal" << endl;
+            return false;
+        }
+    }
+
+    /* The survivors must still be found through views of a shared buffer */
+    char key[16];
+    for(int i = 1; i < NUMACCTS * 10; i += 2) {
+        int length = snprintf(key, sizeof(key), "user%d", 1000 + i);
+        if(utree.numUsers(std::string_view(key, length)) != 1) {
+            cout << key << " was lost while removing its neighbours" << endl;
+            return false;
+        }
+    }
+    return isAVL(utree._root);
+}
+
+bool Tester::testBulkLoad(UTree& utree) {
+    string dataFile = "accounts.csv";
+    UTree incremental;
+    try {
+        incremental.loadData(dataFile);
+        utree.loadData(dataFile, false, true);
+    } catch(std::invalid_argument& e) {
+        std::cerr << e.what() << endl;
+        return false;
+    }
+
+    /* Both load paths must hold the same accounts in the same order */
+    std::vector<Account> expected, actual;
+    incremental.collectAccounts(incremental._root, expected);
+    utree.collectAccounts(utree._root, actual);
+    if(expected.size() != actual.size()) {
+        cout << "Bulk load kept " << actual.size() << " accounts, expected " << expected.size() << endl;
+        return false;
+    }
+    for(size_t i = 0; i < expected.size(); i++) {
+        if(expected[i].getUsername() != actual[i].getUsername() ||
+           expected[i].getDiscriminator() != actual[i].getDiscriminator()) {
+            cout << "Bulk load differs at account " << i << endl;
+            return false;
+        }
+    }
+    return isAVL(utree._root);
+}
+
+bool Tester::testBatchRetrieve(UTree& utree) {
+    /* Every stored account, interleaved with keys that miss on the username or the discriminator */
+    std::vector<Account> accounts;
+    utree.collectAccounts(utree._root, accounts);
+    std::vector<string> missing;
+    for(size_t i = 0; i < accounts.size(); i++) missing.push_back(accounts[i].getUsername() + "_");
+
+    std::vector<UserKey> keys;
+    for(size_t i = 0; i < accounts.size(); i++) {
+        keys.push_back({accounts[i].getUsername(), accounts[i].getDiscriminator()});
+        keys.push_back({missing[i], accounts[i].getDiscriminator()});
+        keys.push_back({accounts[i].getUsername(), RANDDISC});
+    }
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    /* Odd batch sizes leave some lanes idle */
+    for(int batch : {1, 7, BATCH_LANES, 100, static_cast<int>(keys.size())}) {
+        std::vector<DNode*> results(batch);
+        for(size_t first = 0; first < keys.size(); first += batch) {
+            int count = static_cast<int>(std::min<size_t>(batch, keys.size() - first));
+            utree.retrieveUserBatch(&keys[first], count, results.data());
+            for(int i = 0; i < count; i++) {
+                if(results[i] != utree.retrieveUser(keys[first + i].username, keys[first + i].disc)) {
+                    cout << "Batch of " << batch << " disagrees on " << keys[first + i].username << endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+#ifdef HAVE_COROUTINE_LOOKUPS
+bool Tester::testCoroutineLookups(UTree& utree) {
+    /* Username-only and full lookups, hits and misses, all in flight together */
+    std::vector<Account> accounts;
+    utree.collectAccounts(utree._root, accounts);
+    std::vector<string> usernames;
+    for(const Account& acct : accounts) usernames.push_back(acct.getUsername());
+    usernames.push_back("");
+    usernames.push_back("~not a user");
+
+    std::vector<Lookup<UNode*>> userLookups;
+    std::vector<Lookup<DNode*>> accountLookups;
+    std::vector<int> discs;
+    for(const string& username : usernames) {
+        userLookups.push_back(utree.retrieveAsync(username));
+        discs.push_back(RANDDISC);
+        accountLookups.push_back(utree.retrieveUserAsync(username, discs.back()));
+    }
+    for(const Account& acct : accounts) {
+        discs.push_back(acct.getDiscriminator());
+        accountLookups.push_back(utree.retrieveUserAsync(acct.getUsername(), discs.back()));
+    }
+
+    LookupScheduler scheduler(BATCH_LANES);
+    for(size_t i = 0; i < accountLookups.size(); i++) {
+        if(i < userLookups.size()) scheduler.add(userLookups[i]);
+        scheduler.add(accountLookups[i]);
+    }
+    scheduler.run();
+
+    for(size_t i = 0; i < userLookups.size(); i++) {
+        if(!userLookups[i].done() || userLookups[i].result() != utree.retrieve(usernames[i])) {
+            cout << "Username lookup of " << usernames[i] << " disagrees with retrieve()" << endl;
+            return false;
+        }
+    }
+    for(size_t i = 0; i < accountLookups.size(); i++) {
+        const string& username = (i < usernames.size() ? usernames[i] : accounts[i - usernames.size()].getUsername());
+        if(!accountLookups[i].done() || accountLookups[i].result() != utree.retrieveUser(username, discs[i])) {
+            cout << "Account lookup of " << username << "#" << discs[i] << " disagrees with retrieveUser()" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+bool Tester::testScans(UTree& utree) {
+    /* Short names over a small alphabet so prefixes and bounds land on and between usernames */
+    std::vector<string> usernames;
+    for(int i = 0; i < NUMACCTS * 50; i++) {
+        string username(1 + distAcct(rng) % 4, 'a');
+        for(char& c : username) c = static_cast<char>('a' + distAcct(rng) % 3);
+        utree.insert(Account(username, RANDDISC, 0, "", ""));
+        usernames.push_back(username);
+    }
+    std::sort(usernames.begin(), usernames.end());
+    usernames.erase(std::unique(usernames.begin(), usernames.end()), usernames.end());
+
+    std::vector<string> visited;
+    for(UNode* node : utree) visited.push_back(node->getUsername());
+    if(visited != usernames) {
+        cout << "In-order iteration does not match the sorted usernames" << endl;
+        return false;
+    }
+
+    std::vector<string> bounds = {"", "a", "ab", "abc", "b", "ba", "bcc", "c", "cccc", "d"};
+    for(const string& lo : bounds) {
+        std::vector<string> expectedPrefix, expectedRange, prefix, range;
+        for(const string& username : usernames)
+            if(username.compare(0, lo.size(), lo) == 0) expectedPrefix.push_back(username);
+        for(UNode* node : utree.prefixScan(lo)) prefix.push_back(node->getUsername());
+
+        for(const string& hi : bounds) {
+            expectedRange.clear();
+            range.clear();
+            for(const string& username : usernames)
+                if(username >= lo && username <= hi) expectedRange.push_back(username);
+            for(UNode* node : utree.rangeScan(lo, hi)) range.push_back(node->getUsername());
+            if(range != expectedRange) {
+                cout << "rangeScan(\"" << lo << "\", \"" << hi << "\") mismatch" << endl;
+                return false;
+            }
+        }
+
+        /* The visitor form stops at the limit */
+        std::vector<string> limited;
+        int count = utree.prefixScan(lo, [&limited](UNode* node) {limited.push_back(node->getUsername());}, 3);
+        expectedPrefix.resize(std::min<size_t>(expectedPrefix.size(), 3));
+        prefix.resize(std::min<size_t>(prefix.size(), 3));
+        if(prefix != expectedPrefix || limited != expectedPrefix || count != static_cast<int>(limited.size())) {
+            cout << "prefixScan(\"" << lo << "\") mismatch" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Tester::testAllocateDiscriminator(UTree& utree) {
+    const string username = "popular";
+    if(utree.allocateDiscriminator(username) != MIN_DISC) {
+        cout << "An unknown username should get the lowest discriminator" << endl;
+        return false;
+    }
+
+    /* Fill the name in random order, freeing some as we go so vacant nodes are reused */
+    std::vector<bool> live(MAX_DISC + 1, false);
+    Account removed;
+    for(int i = 0; i < MAX_DISC + 1; i++) {
+        if(i % 4 == 3) {
+            int disc = RANDDISC;
+            utree.removeUser(username, disc, removed);
+            live[disc] = false;
+            continue;
+        }
+        int lowest = utree.allocateDiscriminator(username, LOWEST_FREE);
+        int random = utree.allocateDiscriminator(username, RANDOM_FREE);
+        int expected = static_cast<int>(std::find(live.begin() + MIN_DISC, live.end(), false) - live.begin());
+        if(lowest != expected || random < MIN_DISC || random > MAX_DISC || live[random]) {
+            cout << "allocateDiscriminator returned " << lowest << " and " << random
+                 << ", lowest free is " << expected << endl;
+            return false;
+        }
+        int disc = (i % 2 == 0 ? lowest : random);
+        if(!utree.insert(Account(username, disc, 0, "", ""))) {
+            cout << "Allocated discriminator " << disc << " was already taken" << endl;
+            return false;
+        }
+        live[disc] = true;
+    }
+
+    /* Finish filling the name, after which allocation has to fail */
+    while(utree.numUsers(username) < MAX_DISC - MIN_DISC + 1)
+        utree.insert(Account(username, utree.allocateDiscriminator(username, RANDOM_FREE), 0, "", ""));
+    try {
+        utree.allocateDiscriminator(username);
+    } catch(const std::out_of_range&) {
+        return true;
+    }
+    cout << "A full username still allocated a discriminator" << endl;
+    return false;
+}
+
+bool Tester::testSecondaryIndex(UTree& utree) {
+    /* Half the accounts are indexed on the fly, the other half by the rebuild when enabled */
+    utree.loadData("accounts.csv");
+    utree.enableIndex();
+    const char* badges[] = {"", "Subscriber", "Server Booster"};
+    for(int i = 0; i < NUMACCTS * 40; i++) {
+        utree.emplace("user" + std::to_string(i % 50), RANDDISC, i % 3 == 0, badges[i % 3], (i % 4 == 0 ? "away" : ""));
+    }
+    Account removed;
+    std::vector<Account> accounts;
+    utree.collectAccounts(utree._root, accounts);
+    for(size_t i = 0; i < accounts.size(); i += 5)
+        utree.removeUser(accounts[i].getUsername(), accounts[i].getDiscriminator(), removed);
+
+    /* Each filter must match a full scan of the tree */
+    const AccountIndex& index = *utree.getIndex();
+    auto subscriberNitro = [](const Account& acct) {return acct.getBadge() == "Subscriber" && acct.hasNitro();};
+    auto statusOrBooster = [](const Account& acct) {return !acct.getStatus().empty() || acct.getBadge() == "Server Booster";};
+    auto noBadgeNoNitro = [](const Account& acct) {return acct.getBadge().empty() && !acct.hasNitro();};
+    std::vector<std::pair<AccountBitmap, std::function<bool(const Account&)>>> filters = {
+        {index.withBadge("Subscriber") & index.nitro(), subscriberNitro},
+        {index.hasStatus() | index.withBadge("Server Booster"), statusOrBooster},
+        {index.negate(index.nitro()) - index.negate(index.withBadge("")), noBadgeNoNitro}
+    };
+
+    accounts.clear();
+    utree.collectAccounts(utree._root, accounts);
+    for(size_t f = 0; f < filters.size(); f++) {
+        std::vector<std::pair<const string*, int>> expected, actual;
+        for(const Account& acct : accounts)
+            if(filters[f].second(acct)) expected.push_back({&acct.getUsername(), acct.getDiscriminator()});
+        index.forEach(filters[f].first, [&actual](const Account& acct) {
+            actual.push_back({&acct.getUsername(), acct.getDiscriminator()});
+        });
+        std::sort(expected.begin(), expected.end());
+        std::sort(actual.begin(), actual.end());
+        if(expected.empty() || actual != expected || filters[f].first.count() != expected.size()) {
+            cout << "Filter " << f << " matched " << actual.size() << " accounts, expected " << expected.size() << endl;
+            return false;
+        }
+    }
+    if(index.getNumAccounts() != accounts.size() || index.withBadge("Unseen badge").count() != 0) {
+        cout << "Index holds " << index.getNumAccounts() << " accounts, the tree " << accounts.size() << endl;
+        return false;
+    }
+
+    /* A bulk load replaces the tree, the index is rebuilt from the result */
+    utree.loadData("accounts.csv", true, true);
+    accounts.clear();
+    utree.collectAccounts(utree._root, accounts);
+    return index.getNumAccounts() == accounts.size() && index.all().count() == accounts.size();
+}
+
+bool Tester::testManyBadges(UTree& utree) {
+    /* Far more badges than fit in one chunk of names, each on its own user */
+    const int numBadges = BADGE_CHUNK + 44;
+    utree.enableIndex();
+    try {
+        for(int b = 0; b < numBadges; b++) {
+            string badge = "Badge " + std::to_string(b);
+            for(int i = 0; i <= b % 3; i++) {
+                utree.insert(Account("collector" + std::to_string(b % 10), b * 3 + i, i % 2, badge, ""));
+            }
+        }
+    } catch(std::out_of_range& e) {
+        cout << e.what() << endl;
+        return false;
+    }
+    if(BadgeDictionary::getNumBadges() <= numBadges) {
+        cout << "Only " << BadgeDictionary::getNumBadges() << " badges were registered" << endl;
+        return false;
+    }
+
+    auto countsMatch = [&](UTree& tree, bool indexed) {
+        for(int b = 0; b < numBadges; b++) {
+            string badge = "Badge " + std::to_string(b);
+            int expected = b % 3 + 1;
+            DNode* node = tree.retrieveUser("collector" + std::to_string(b % 10), b * 3);
+            if(node == nullptr || node->getAccount().getBadge() != badge ||
+               tree.numWithBadge("collector" + std::to_string(b % 10), badge) != expected ||
+               (indexed && tree.getIndex()->withBadge(badge).count() != static_cast<size_t>(expected))) {
+                cout << "Badge " << b << " lost its accounts" << endl;
+                return false;
+            }
+        }
+        return true;
+    };
+    if(!countsMatch(utree, true)) {
+        return false;
+    }
+
+    /* Removing every account with a badge leaves its count at zero */
+    Account removed;
+    for(int i = 0; i < 3; i++) {
+        utree.removeUser("collector5", 5 * 3 + i, removed);
+    }
+    if(utree.numWithBadge("collector5", "Badge 5") != 0 || utree.getIndex()->withBadge("Badge 5").count() != 0) {
+        cout << "Removed badge is still counted" << endl;
+        return false;
+    }
+    for(int i = 0; i < 3; i++) {
+        utree.insert(Account("collector5", 5 * 3 + i, i % 2, "Badge 5", ""));
+    }
+
+    /* Snapshots carry the wider badge ids */
+    string snapshotFile = "test_badges.bin";
+    UTree restored;
+    try {
+        utree.saveSnapshot(snapshotFile);
+        restored.loadSnapshot(snapshotFile);
+    } catch(std::invalid_argument& e) {
+        std::cerr << e.what() << endl;
+        return false;
+    }
+    std::remove(snapshotFile.c_str());
+    return countsMatch(restored, false) && isAVL(utree._root);
+}
+
+bool Tester::testStats(UTree& utree) {
+    StatsRegistry::reset();
+    for(int i = 0; i < NUMACCTS * 50; i++)
+        utree.insert(Account("user" + std::to_string(1000 + i / 5), RANDDISC, 0, "", ""));
+    Account removed;
+    for(int i = 0; i < NUMACCTS * 50; i += 3)
+        utree.removeUser("user" + std::to_string(1000 + i / 5), utree.allocateDiscriminator("unused") + i % 7, removed);
+
+    /* The shape must agree with the tree itself */
+    UTreeStats before = utree.stats();
+    std::vector<Account> accounts;
+    utree.collectAccounts(utree._root, accounts);
+    int usersByDepth = 0;
+    for(int count : before.depthHistogram) usersByDepth += count;
+    if(before.numAccounts != static_cast<int>(accounts.size()) || usersByDepth != before.numUsers ||
+       before.height != utree._root->getHeight() + 1 || before.numDNodes != before.numAccounts + before.numVacant ||
+       before.bytesAllocated == 0 || before.worstVacantRatio < before.vacantRatio) {
+        cout << "stats() disagrees with the tree's shape" << endl;
+        return false;
+    }
+
+    /* With counters compiled in, every lookup is seen by both trees */
+    for(const Account& acct : accounts)
+        utree.retrieveUser(acct.getUsername(), acct.getDiscriminator());
+    UTreeStats after = utree.stats();
+    if(!StatsRegistry::isEnabled())
+        return after.utreeCounters.lookups == 0 && after.dtreeCounters.rebalances == 0;
+
+    uint64_t lookups = after.dtreeCounters.lookups - before.dtreeCounters.lookups;
+    uint64_t byDepth = 0;
+    for(uint64_t count : after.dtreeCounters.lookupDepths) byDepth += count;
+    return after.utreeCounters.lookups - before.utreeCounters.lookups == accounts.size() &&
+           lookups == accounts.size() && byDepth == after.dtreeCounters.lookups &&
+           after.utreeCounters.rebalances > 0 && after.dtreeCounters.rebalances > 0 &&
+           after.utreeCounters.comparisonsPerLookup() <= before.height;
+}
+
+bool Tester::testEmplace(UTree& utree) {
+    /* Views into a larger buffer must be interned by content, not by address */
+    string line = "alice,bob,Subscriber,online";
+    std::string_view alice(line.data(), 5), bob(line.data() + 6, 3);
+    std::string_view badge(line.data() + 10, 10), status(line.data() + 21, 6);
+
+    std::pair<DNode*, bool> first = utree.emplace(alice, 7, true, badge, status);
+    std::pair<DNode*, bool> again = utree.emplace(string("alice"), 7, false, "", "");
+    std::pair<DNode*, bool> other = utree.emplace(bob, 7, false, "", status);
+    if(!first.second || again.second || again.first != first.first || !other.second) {
+        cout << "emplace returned the wrong node or flag" << endl;
+        return false;
+    }
+
+    const Account& acct = first.first->getAccount();
+    if(acct.getUsername() != "alice" || acct.getBadge() != "Subscriber" || acct.getStatus() != "online" ||
+       !acct.hasNitro() || &acct.getStatus() != &other.first->getAccount().getStatus()) {
+        cout << "emplace did not intern the account's fields" << endl;
+        return false;
+    }
+    return utree.retrieveUser("bob", 7) == other.first && utree.numUsers("alice") == 1 &&
+           utree.numNitro("alice") == 1 && utree.numNitro("bob") == 0 &&
+           utree.numWithBadge("alice", "Subscriber") == 1 && utree.numWithBadge("bob", "") == 1;
+}
+
+bool Tester::testParallelLoad(UTree& utree) {
+    string dataFile = "accounts.csv";
+    UTree incremental;
+    try {
+        incremental.loadData(dataFile);
+        utree.loadDataParallel(dataFile, 4, false);
+    } catch(std::invalid_argument& e) {
+        std::cerr << e.what() << endl;
+        return false;
+    }
+
+    /* Sharding must not change which accounts end up in the tree */
+    std::vector<Account> expected, actual;
+    incremental.collectAccounts(incremental._root, expected);
+    utree.collectAccounts(utree._root, actual);
+    if(expected.size() != actual.size()) {
+        cout << "Parallel load kept " << actual.size() << " accounts, expected " << expected.size() << endl;
+        return false;
+    }
+    for(size_t i = 0; i < expected.size(); i++) {
+        if(expected[i].getUsername() != actual[i].getUsername() ||
+           expected[i].getDiscriminator() != actual[i].getDiscriminator() ||
+           expected[i].getStatus() != actual[i].getStatus()) {
+            cout << "Parallel load differs at account " << i << endl;
+            return false;
+        }
+    }
+    return isAVL(utree._root);
+}
+
+bool Tester::testMalformedLines(UTree& utree) {
+    string dataFile = "test_malformed.csv";
+    {
+        std::ofstream out(dataFile, std::ios::binary);
+        out << "alice,1,0,,online\n"          /* 1: valid */
+            << "bob,2,1\n"                     /* 2: too few fields */
+            << "carol,abc,0,,\n"               /* 3: non-numeric discriminator */
+            << "\n"                            /* 4: blank, skipped silently */
+            << "dave,12345,0,,\n"              /* 5: discriminator out of range */
+            << "erin,7,1,Partner,away,extra\n" /* 6: too many fields */
+            << "frank,8,x,,\n"                 /* 7: non-numeric nitro */
+            << "gina,9,1,,idle";               /* 8: valid, no trailing newline */
+    }
+    const int badLines[] = {2, 3, 5, 6, 7};
+
+    /* Every load path shares the parser, so each must skip and report the same rows */
+    bool passed = true;
+    for(int path = 0; path < 3 && passed; path++) {
+        std::ostringstream errors;
+        std::streambuf* saved = std::cerr.rdbuf(errors.rdbuf());
+        try {
+            if(path == 0) utree.loadData(dataFile, false);
+            else if(path == 1) utree.loadData(dataFile, false, true);
+            else utree.loadDataParallel(dataFile, 4, false);
+        } catch(std::invalid_argument& e) {
+            std::cerr.rdbuf(saved);
+            std::cerr << e.what() << endl;
+            std::remove(dataFile.c_str());
+            return false;
+        }
+        std::cerr.rdbuf(saved);
+
+        string report = errors.str();
+        int numReports = static_cast<int>(std::count(report.begin(), report.end(), '\n'));
+        if(numReports != 5) {
+            cout << "Load path " << path << " reported " << numReports << " bad rows, expected 5" << endl;
+            passed = false;
+        }
+        for(int line : badLines) {
+            if(report.find(dataFile + ":" + std::to_string(line) + ":") == string::npos) {
+                cout << "Load path " << path << " did not report line " << line << endl;
+                passed = false;
+            }
+        }
+
+        DNode* gina = utree.retrieveUser("gina", 9);
+        passed = passed && utree.numUsers("alice") == 1 && gina != nullptr && gina->getAccount().hasNitro()
+                 && gina->getAccount().getStatus() == "idle" && utree.retrieve("bob") == nullptr
+                 && utree.retrieve("carol") == nullptr && utree.retrieve("dave") == nullptr
+                 && utree.retrieve("erin") == nullptr && utree.retrieve("frank") == nullptr
+                 && isAVL(utree._root);
+    }
+
+    std::remove(dataFile.c_str());
+    return passed;
+}
+
+bool Tester::testConcurrentReads(ConcurrentUTree& ctree) {
+    const int numReaders = 3;
+    const int numWrites = NUMACCTS * 50;
+    std::atomic<int> written(0);
+    std::atomic<bool> consistent(true);
+
+    /* Readers check that every acknowledged insert stays visible */
+    std::vector<std::thread> readers;
+    for(int r = 0; r < numReaders; r++) {
+        readers.emplace_back([&]() {
+            while(written.load() < numWrites) {
+                int seen = written.load();
+                for(int i = std::max(0, seen - 10); i < seen; i++) {
+                    Account found;
+                    if(!ctree.retrieveUser("user" + std::to_string(i), i % (MAX_DISC + 1), found) ||
+                       ctree.numUsers("user" + std::to_string(i)) != 1) {
+                        consistent = false;
+                    }
+                }
+            }
+        });
+    }
+
+    for(int i = 0; i < numWrites; i++) {
+        if(!ctree.insert(Account("user" + std::to_string(i), i % (MAX_DISC + 1), 0, "", ""))) {
+            consistent = false;
+        }
+        written.store(i + 1);
+    }
+    for(std::thread& reader : readers) {
+        reader.join();
+    }
+
+    Account removed;
+    if(!ctree.removeUser("user0", 0, removed) || removed.getUsername() != "user0" || ctree.numUsers("user0") != 0) {
+        cout << "Removal through the concurrent tree failed" << endl;
+        return false;
+    }
+
+    /* A load reaches both copies, the second only becomes visible after the next write */
+    std::atomic<bool> loading(true);
+    std::thread reader([&]() {
+        while(loading.load()) {
+            if(ctree.numUsers("user1") != 1) consistent = false;
+        }
+    });
+    try {
+        ctree.loadData("accounts.csv");
+    } catch(std::invalid_argument& e) {
+        std::cerr << e.what() << endl;
+        consistent = false;
+    }
+    loading = false;
+    reader.join();
+    UTree expected;
+    expected.loadData("accounts.csv");
+    for(int copy = 0; copy < 2; copy++) {
+        for(URangeIterator it = expected.begin(); it != expected.end(); ++it) {
+            if(ctree.numUsers(it->getUsername()) != it->getDTree()->getNumUsers()) {
+                cout << "Copy " << copy << " of the concurrent tree missed loaded accounts" << endl;
+                return false;
+            }
+        }
+        ctree.insert(Account("flip" + std::to_string(copy), MIN_DISC, 0, "", ""));
+    }
+    return consistent && ctree.numUsers("user1") == 1;
+}
+
+bool Tester::testSnapshot(UTree& utree) {
+    string dataFile = "accounts.csv";
+    string snapshotFile = "test_snapshot.bin";
+    UTree source;
+    try {
+        source.loadData(dataFile);
+        source.saveSnapshot(snapshotFile);
+        utree.loadSnapshot(snapshotFile);
+    } catch(std::invalid_argument& e) {
+        std::cerr << e.what() << endl;
+        return false;
+    }
+
+    /* Every field must survive the round trip */
+    std::vector<Account> expected, actual;
+    source.collectAccounts(source._root, expected);
+    utree.collectAccounts(utree._root, actual);
+    bool identical = (expected.size() == actual.size());
+    for(size_t i = 0; identical && i < expected.size(); i++) {
+        identical = expected[i].getUsername() == actual[i].getUsername() &&
+                    expected[i].getDiscriminator() == actual[i].getDiscriminator() &&
+                    expected[i].hasNitro() == actual[i].hasNitro() &&
+                    expected[i].getBadge() == actual[i].getBadge() &&
+                    expected[i].getStatus() == actual[i].getStatus();
+    }
+    if(!identical) {
+        cout << "Snapshot round trip changed the accounts" << endl;
+    }
+
+    /* A flipped byte must be caught by the checksum */
+    std::fstream corrupt(snapshotFile, std::ios::in | std::ios::out | std::ios::binary);
+    corrupt.seekp(40);
+    corrupt.put('X');
+    corrupt.close();
+    bool rejected = false;
+    try {
+        UTree damaged;
+        damaged.loadSnapshot(snapshotFile);
+    } catch(std::invalid_argument& e) {
+        rejected = true;
+    }
+    if(!rejected) {
+        cout << "Corrupt snapshot was accepted" << endl;
+    }
+
+    std::remove(snapshotFile.c_str());
+    return identical && rejected && isAVL(utree._root);
+}
+
+bool Tester::testUTreeCopy(UTree& utree) {
+    const int numUsers = 200;
+    for(int i = 0; i < NUMACCTS * 50; i++) {
+        utree.insert(Account("user" + std::to_string(i % numUsers), RANDDISC, i % 2, "", ""));
+    }
+    std::vector<Account> before;
+    utree.collectAccounts(utree._root, before);
+    size_t height = utree.stats().height;
+
+    {
+        UTree copy(utree);
+        if(copy._root != utree._root || utree._unodePool.getNumLive() != static_cast<size_t>(numUsers)) {
+            cout << "Copy did not share the nodes" << endl;
+            return false;
+        }
+
+        /* A new account for an existing user copies the UNodes on its path and nothing else */
+        int disc = copy.allocateDiscriminator("user7");
+        copy.insert(Account("user7", disc, 0, "", ""));
+        size_t copied = utree._unodePool.getNumLive() - numUsers;
+        if(copied == 0 || copied > height || utree.retrieveUser("user7", disc) != nullptr ||
+           copy.retrieveUser("user7", disc) == nullptr) {
+            cout << "Insert into the copy made " << copied << " UNodes" << endl;
+            return false;
+        }
+
+        /* Emptying users out of the copy removes and rotates its UNodes, the original stays whole */
+        Account removed;
+        for(int u = 0; u < numUsers; u += 3) {
+            string username = "user" + std::to_string(u);
+            while(copy.numUsers(username) > 0) {
+                copy.removeUser(username, copy.retrieve(username)->_dtree->select(0)->getDiscriminator(), removed);
+            }
+        }
+        for(int i = 0; i < NUMACCTS * 10; i++) {
+            copy.insert(Account("fresh" + std::to_string(i), i, 0, "", ""));
+        }
+
+        std::vector<Account> after;
+        utree.collectAccounts(utree._root, after);
+        bool unchanged = (after.size() == before.size());
+        for(size_t i = 0; unchanged && i < before.size(); i++) {
+            unchanged = &after[i].getUsername() == &before[i].getUsername() &&
+                        after[i].getDiscriminator() == before[i].getDiscriminator();
+        }
+        if(!unchanged || copy.numUsers("user0") != 0 || copy.numUsers("fresh0") != 1 || utree.numUsers("fresh0") != 0) {
+            cout << "Changes to the copy reached the original" << endl;
+            return false;
+        }
+        if(!isAVL(utree._root) || !isAVL(copy._root)) {
+            return false;
         }
     }
-    return allInserted;
+
+    /* A copy handed to another thread is read and dropped there while the original changes */
+    UTree* report = new UTree(utree);
+    std::atomic<bool> matched(true);
+    std::thread reader([&]() {
+        std::vector<Account> seen;
+        report->collectAccounts(report->_root, seen);
+        matched = (seen.size() == before.size());
+        for(size_t i = 0; matched && i < seen.size(); i++) {
+            matched = &seen[i].getUsername() == &before[i].getUsername() &&
+                      seen[i].getDiscriminator() == before[i].getDiscriminator();
+        }
+        delete report;
+    });
+    Account removed;
+    for(int i = 0; i < NUMACCTS * 50; i++) {
+        string username = "user" + std::to_string(i % numUsers);
+        if(i % 2 == 0) {
+            utree.insert(Account(username, RANDDISC, 0, "", ""));
+        } else if(utree.numUsers(username) > 0) {
+            utree.removeUser(username, utree.retrieve(username)->_dtree->select(0)->getDiscriminator(), removed);
+        }
+    }
+    reader.join();
+    if(!matched) {
+        cout << "The copy read on another thread saw the original's changes" << endl;
+        return false;
+    }
+
+    /* Indexes are not shared, a copy starts without them and an assigned tree rebuilds its own */
+    utree.enableIndex();
+    UTree unindexed(utree);
+    UTree indexed;
+    indexed.enableIndex();
+    indexed = utree;
+    if(unindexed.getIndex() != nullptr || indexed.getIndex()->getNumAccounts() != utree.getIndex()->getNumAccounts()) {
+        cout << "Copies did not handle the secondary indexes" << endl;
+        return false;
+    }
+    return isAVL(utree._root);
 }
 
-bool Tester::testBasicUTreeInsert(UTree& utree) {
-    string dataFile = "accounts.csv";
+bool Tester::testJournal(DurableUTree& durable) {
+    string baseFile = "test_base.bin";
+    string journalFile = "test_journal.bin";
+    string nextFile = journalFile + JOURNAL_NEXT_SUFFIX;
+    for(const string& file : {baseFile, journalFile, nextFile}) {
+        std::remove(file.c_str());
+    }
+    auto fileSize = [](const string& path) {
+        struct stat info;
+        return (stat(path.c_str(), &info) == 0 ? static_cast<long>(info.st_size) : -1L);
+    };
+
+    /* Every replayed tree is compared against a model given the same mutations */
+    UTree model;
+    auto matches = [&](DurableUTree& reopened) {
+        UTree replayed = reopened.snapshot();
+        std::vector<Account> expected, actual;
+        model.collectAccounts(model._root, expected);
+        replayed.collectAccounts(replayed._root, actual);
+        bool identical = (expected.size() == actual.size());
+        for(size_t i = 0; identical && i < expected.size(); i++) {
+            identical = expected[i].getUsername() == actual[i].getUsername() &&
+                        expected[i].getDiscriminator() == actual[i].getDiscriminator() &&
+                        expected[i].hasNitro() == actual[i].hasNitro() &&
+                        expected[i].getBadge() == actual[i].getBadge() &&
+                        expected[i].getStatus() == actual[i].getStatus();
+        }
+        if(!identical) {
+            cout << "Replayed " << actual.size() << " accounts, expected " << expected.size() << endl;
+        }
+        return identical && isAVL(replayed._root);
+    };
+    std::mt19937 churnRng(10);
+    std::uniform_int_distribution<> distChurnDisc(MIN_DISC, MIN_DISC + 15);
+    auto churn = [&](DurableUTree& target, int count) {
+        Account removed;
+        Account modelRemoved;
+        for(int i = 0; i < count; i++) {
+            string username = "user" + std::to_string(i % 15);
+            int disc = distChurnDisc(churnRng);
+            if(i % 3 == 2) {
+                bool gone = target.removeUser(username, disc, removed);
+                if(gone != model.removeUser(username, disc, modelRemoved)) return false;
+            } else {
+                Account acct(username, disc, i % 2, (i % 4 ? "" : "Subscriber"), "status " + std::to_string(i));
+                if(target.insert(acct) != model.insert(acct)) return false;
+            }
+        }
+        return true;
+    };
+
     try {
-        utree.loadData(dataFile);
-    } catch(std::invalid_argument e) {
+        /* Mutations survive closing and reopening */
+        durable.open(baseFile, journalFile);
+        if(!churn(durable, NUMACCTS * 20)) {
+            cout << "Journaled tree disagrees with the model" << endl;
+            return false;
+        }
+        durable.close();
+        DurableUTree reopened;
+        reopened.open(baseFile, journalFile);
+        if(reopened.getNumReplayed() == 0 || !matches(reopened)) {
+            return false;
+        }
+
+        /* A record cut short by a crash is dropped, and records appended after it are kept */
+        reopened.close();
+        long intact = fileSize(journalFile);
+        std::ofstream torn(journalFile, std::ios::app | std::ios::binary);
+        torn.write("\x30\0\0\0\x11\x22\x33", 7);
+        torn.close();
+        reopened.open(baseFile, journalFile);
+        if(fileSize(journalFile) != intact || reopened.getNumDropped() != 7 || !matches(reopened) ||
+           !churn(reopened, NUMACCTS)) {
+            cout << "Torn record was not dropped" << endl;
+            return false;
+        }
+        reopened.close();
+        reopened.open(baseFile, journalFile);
+        if(!matches(reopened)) {
+            return false;
+        }
+
+        /* Compaction folds the journal into the base */
+        reopened.compact();
+        if(fileSize(journalFile) != JOURNAL_HEADER_SIZE || fileSize(nextFile) != -1) {
+            cout << "Compaction left " << fileSize(journalFile) << " journal bytes" << endl;
+            return false;
+        }
+        reopened.close();
+        reopened.open(baseFile, journalFile);
+        if(reopened.getNumReplayed() != 0 || !matches(reopened) || !churn(reopened, NUMACCTS * 5)) {
+            return false;
+        }
+        reopened.close();
+
+        /* A compaction that crashed before its journal replaced the old one is finished on open */
+        Journal next;
+        next.open(nextFile, JournalOptions(), true, Journal::generationOf(journalFile) + 1);
+        Account modelRemoved;
+        for(int i = 0; i < NUMACCTS; i++) {
+            Account acct("late" + std::to_string(i), MIN_DISC + i, 0, "", "");
+            model.insert(acct);
+            next.commit(next.append(JOURNAL_INSERT, acct));
+        }
+        if(model.removeUser("late0", MIN_DISC, modelRemoved)) {
+            next.commit(next.append(JOURNAL_REMOVE, modelRemoved));
+        }
+        next.close();
+        reopened.open(baseFile, journalFile);
+        if(fileSize(nextFile) != -1 || fileSize(journalFile) != JOURNAL_HEADER_SIZE || !matches(reopened)) {
+            cout << "Interrupted compaction was not finished" << endl;
+            return false;
+        }
+
+        /* Writers on many threads share syncs and lose nothing, even with a compaction midway */
+        const int numThreads = 4;
+        std::vector<std::thread> writers;
+        std::atomic<int> failed(0);
+        for(int t = 0; t < numThreads; t++) {
+            writers.emplace_back([&, t]() {
+                for(int i = 0; i < NUMACCTS * 5; i++) {
+                    if(!reopened.insert(Account("writer" + std::to_string(t), MIN_DISC + i, 0, "", ""))) failed++;
+                }
+            });
+        }
+        reopened.compact();
+        for(std::thread& writer : writers) {
+            writer.join();
+        }
+        for(int t = 0; t < numThreads; t++) {
+            for(int i = 0; i < NUMACCTS * 5; i++) {
+                model.insert(Account("writer" + std::to_string(t), MIN_DISC + i, 0, "", ""));
+            }
+        }
+        reopened.close();
+        DurableUTree recovered;
+        recovered.open(baseFile, journalFile);
+        if(failed != 0 || !matches(recovered)) {
+            cout << "Concurrent writes were lost" << endl;
+            return false;
+        }
+        recovered.close();
+    } catch(std::invalid_argument& e) {
         std::cerr << e.what() << endl;
         return false;
     }
+
+    for(const string& file : {baseFile, journalFile, nextFile}) {
+        std::remove(file.c_str());
+    }
     return true;
 }
 
+bool Tester::testInterruptedImport(DurableUTree& durable) {
+    string baseFile = "test_import_base.bin";
+    string journalFile = "test_import_journal.bin";
+    string nextFile = journalFile + JOURNAL_NEXT_SUFFIX;
+    string dataFile = "test_import.csv";
+    auto readFile = [](const string& path) {
+        std::ifstream in(path, std::ios::binary);
+        std::ostringstream bytes;
+        bytes << in.rdbuf();
+        return bytes.str();
+    };
+    {
+        std::ofstream out(dataFile, std::ios::binary);
+        out << "reused,1,1,,imported\n" << "fresh,2,0,,imported\n";
+    }
+
+    bool passed = true;
+    for(bool append : {true, false}) {
+        for(const string& file : {baseFile, journalFile, nextFile}) {
+            std::remove(file.c_str());
+        }
+        try {
+            /* The old journal inserts and removes an account the import brings back, and holds one a clearing import drops */
+            durable.open(baseFile, journalFile);
+            Account removed;
+            durable.insert(Account("reused", 1, 0, "", "journaled"));
+            durable.removeUser("reused", 1, removed);
+            durable.insert(Account("kept", 3, 0, "", "journaled"));
+            string oldJournal = readFile(journalFile);
+
+            /* Leave the files of a crash after the import's base was written but before its journal was renamed */
+            durable.loadData(dataFile, append);
+            durable.insert(Account("late", 4, 0, "", "after import"));
+            durable.close();
+            if(std::rename(journalFile.c_str(), nextFile.c_str()) != 0) {
+                throw std::invalid_argument("Journal " + journalFile + " could not be renamed");
+            }
+            std::ofstream(journalFile, std::ios::binary | std::ios::trunc) << oldJournal;
+
+            /* Only the journal newer than the base is replayed, the old one is already in it */
+            Account found;
+            for(int reopen = 0; reopen < 2 && passed; reopen++) {
+                DurableUTree recovered;
+                recovered.open(baseFile, journalFile);
+                passed = recovered.getNumReplayed() == (reopen == 0 ? 1u : 0u)
+                         && recovered.retrieveUser("reused", 1, found) && found.getStatus() == "imported"
+                         && found.hasNitro() && recovered.numUsers("fresh") == 1 && recovered.numUsers("late") == 1
+                         && recovered.numUsers("kept") == (append ? 1 : 0) && access(nextFile.c_str(), F_OK) != 0;
+                recovered.close();
+            }
+            if(!passed) {
+                cout << "Recovery after an interrupted " << (append ? "appending" : "clearing") << " import is wrong" << endl;
+            }
+        } catch(std::invalid_argument& e) {
+            std::cerr << e.what() << endl;
+            passed = false;
+        }
+        if(!passed) {
+            break;
+        }
+    }
+
+    for(const string& file : {baseFile, journalFile, nextFile, dataFile}) {
+        std::remove(file.c_str());
+    }
+    return passed;
+}
+
+bool Tester::testDurableBase(DurableUTree& durable) {
+    string baseFile = "test_durable_base.bin";
+    string journalFile = "test_durable_journal.bin";
+    string nextFile = journalFile + JOURNAL_NEXT_SUFFIX;
+    for(const string& file : {baseFile, journalFile, nextFile}) {
+        std::remove(file.c_str());
+    }
+    auto readFile = [](const string& path) {
+        std::ifstream in(path, std::ios::binary);
+        std::ostringstream bytes;
+        bytes << in.rdbuf();
+        return bytes.str();
+    };
+
+    bool passed = true;
+    try {
+        durable.open(baseFile, journalFile);
+        for(int i = 0; i < NUMACCTS; i++) {
+            durable.insert(Account("base" + std::to_string(i), MIN_DISC + i, 0, "", ""));
+        }
+        durable.compact();
+        string synced = readFile(baseFile);
+        for(int i = 0; i < NUMACCTS; i++) {
+            durable.insert(Account("journaled" + std::to_string(i), MIN_DISC + i, 0, "", ""));
+        }
+
+        /* A base whose bytes cannot be synced must never replace the last one */
+        UTree::_syncFd = [](int) {errno = EIO; return -1;};
+        bool threw = false;
+        try {
+            durable.compact();
+        } catch(std::invalid_argument&) {
+            threw = true;
+        }
+        UTree::_syncFd = fsync;
+        durable.close();
+        if(!threw || readFile(baseFile) != synced) {
+            cout << "A base was replaced before it was synced" << endl;
+            passed = false;
+        }
+
+        /* The journals still hold everything the failed compaction did not fold */
+        DurableUTree recovered;
+        recovered.open(baseFile, journalFile);
+        for(int i = 0; i < NUMACCTS && passed; i++) {
+            passed = recovered.numUsers("base" + std::to_string(i)) == 1
+                     && recovered.numUsers("journaled" + std::to_string(i)) == 1;
+        }
+        passed = passed && access(nextFile.c_str(), F_OK) != 0;
+        recovered.close();
+    } catch(std::invalid_argument& e) {
+        std::cerr << e.what() << endl;
+        passed = false;
+    }
+    UTree::_syncFd = fsync;
+
+    for(const string& file : {baseFile, journalFile, nextFile}) {
+        std::remove(file.c_str());
+    }
+    return passed;
+}
+
+bool Tester::hasValidCounts(DNode* node) {
+    if(node == nullptr) return true;
+    int size = 1 + (node->_left ? node->_left->_size : 0) + (node->_right ? node->_right->_size : 0);
+    int numVacant = node->_vacant + (node->_left ? node->_left->_numVacant : 0) + (node->_right ? node->_right->_numVacant : 0);
+    if(node->_size != size || node->_numVacant != numVacant) {
+        cout << "Stale size or vacant count at " << node->getDiscriminator() << endl;
+        return false;
+    }
+    int numNitro = (!node->_vacant && node->_account.hasNitro()) + (node->_left ? node->_left->_numNitro : 0)
+                   + (node->_right ? node->_right->_numNitro : 0);
+    if(node->_numNitro != numNitro) {
+        cout << "Stale nitro count at " << node->getDiscriminator() << endl;
+        return false;
+    }
+    return hasValidCounts(node->_left) && hasValidCounts(node->_right);
+}
+
+bool Tester::isAVL(UNode* node) {
+    if(node == nullptr) return true;
+    int lHeight = (node->_left == nullptr ? -1 : node->_left->_height);
+    int rHeight = (node->_right == nullptr ? -1 : node->_right->_height);
+    if(node->_height != 1 + std::max(lHeight, rHeight) || std::abs(lHeight - rHeight) > 1) {
+        cout << "AVL property violated at " << node->getUsername() << endl;
+        return false;
+    }
+    if(node->_dtree->_root != nullptr && &node->getUsername() != &node->_dtree->getUsername()) {
+        cout << "Cached username of " << node->getUsername() << " does not match its DTree" << endl;
+        return false;
+    }
+    return isAVL(node->_left) && isAVL(node->_right);
+}
+
 int main() {
     Tester tester;
 
@@ -58,7 +1528,69 @@ int main() {
     dtree.dump();
     cout << endl;
 
-        
+    DTree statTree;
+
+    cout << "Testing DTree order statistics...";
+    if(tester.testOrderStatistics(statTree)) {
+        cout << "test passed" << endl;
+    } else {
+        cout << "test failed" << endl;
+    }
+
+    DTree removeTree;
+
+    cout << "Testing DTree removal...";
+    if(tester.testDTreeRemove(removeTree)) {
+        cout << "test passed" << endl;
+    } else {
+        cout << "test failed" << endl;
+    }
+
+    DTree churnTree;
+
+    cout << "Testing DTree single pass insert...";
+    if(tester.testTryInsert(churnTree)) {
+        cout << "test passed" << endl;
+    } else {
+        cout << "test failed" << endl;
+    }
+
+    DTree countTree;
+
+    cout << "Testing DTree nitro and badge counters...";
+    if(tester.testAggregates(countTree)) {
+        cout << "test passed" << endl;
+    } else {
+        cout << "test failed" << endl;
+    }
+
+    DTree thresholdTree;
+
+    cout << "Testing DTree compaction thresholds...";
+    if(tester.testCompactThreshold(thresholdTree)) {
+        cout << "test passed" << endl;
+    } else {
+        cout << "test failed" << endl;
+    }
+
+    NodePool<DNode> nodePool;
+
+    cout << "Testing DTree node pool...";
+    if(tester.testNodePool(nodePool)) {
+        cout << "test passed" << endl;
+    } else {
+        cout << "test failed" << endl;
+    }
+
+    DTree copiedTree;
+
+    cout << "Testing DTree copy-on-write copies...";
+    if(tester.testDTreeCopy(copiedTree)) {
+        cout << "test passed" << endl;
+    } else {
+        cout << "test failed" << endl;
+    }
+
     /* Basic UTree tests */
     UTree utree;
 
@@ -72,6 +1604,177 @@ int main() {
     cout << "Resulting UTree:" << endl;
     utree.dump();
     cout << endl;
+
+    /* UTree balancing tests */
+    UTree avlTree;
+
+    cout << "\n\nTesting UTree balancing...";
+    if(tester.testUTreeBalance(avlTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    cout << "Testing UTree removal...";
+    if(tester.testUTreeRemove(avlTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    UTree emplaceTree;
+    cout << "Testing UTree emplace...";
+    if(tester.testEmplace(emplaceTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    UTree scanTree;
+    cout << "Testing UTree prefix and range scans...";
+    if(tester.testScans(scanTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    UTree allocTree;
+    cout << "Testing UTree discriminator allocation...";
+    if(tester.testAllocateDiscriminator(allocTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    UTree indexTree;
+    cout << "Testing UTree secondary indexes...";
+    if(tester.testSecondaryIndex(indexTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    UTree badgeTree;
+    cout << "Testing UTree with many badges...";
+    if(tester.testManyBadges(badgeTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    UTree statsTree;
+    cout << "Testing UTree and DTree stats...";
+    if(tester.testStats(statsTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    /* Bulk load tests */
+    UTree bulkTree;
+
+    cout << "\n\nTesting UTree bulk load...";
+    if(tester.testBulkLoad(bulkTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    cout << "Resulting UTree:" << endl;
+    bulkTree.dump();
+    cout << endl;
+
+    cout << "Testing UTree batched retrieval...";
+    if(tester.testBatchRetrieve(bulkTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+#ifdef HAVE_COROUTINE_LOOKUPS
+    cout << "Testing UTree coroutine lookups...";
+    if(tester.testCoroutineLookups(bulkTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+#endif
+
+    UTree parallelTree;
+
+    cout << "Testing UTree parallel load...";
+    if(tester.testParallelLoad(parallelTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    UTree malformedTree;
+
+    cout << "Testing UTree malformed line reporting...";
+    if(tester.testMalformedLines(malformedTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    /* Concurrent reader tests */
+    ConcurrentUTree concurrentTree;
+
+    cout << "\n\nTesting concurrent reads during writes...";
+    if(tester.testConcurrentReads(concurrentTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    /* Snapshot tests */
+    UTree snapshotTree;
+
+    cout << "\n\nTesting UTree snapshot save and restore...";
+    if(tester.testSnapshot(snapshotTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    /* Copy-on-write tests */
+    UTree copiedUTree;
+
+    cout << "\n\nTesting UTree copy-on-write copies...";
+    if(tester.testUTreeCopy(copiedUTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    /* Journal tests */
+    DurableUTree durableTree;
+
+    cout << "\n\nTesting journaled writes, replay and compaction...";
+    if(tester.testJournal(durableTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    DurableUTree importTree;
+
+    cout << "Testing recovery from an interrupted import...";
+    if(tester.testInterruptedImport(importTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
+
+    DurableUTree syncedTree;
+
+    cout << "Testing that a base is synced before it replaces the last one...";
+    if(tester.testDurableBase(syncedTree)) {
+      cout << "test passed" << endl;
+    } else {
+      cout << "test failed" << endl;
+    }
     
     return 0;
 }
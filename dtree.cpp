@@ -6,6 +6,7 @@
  */
 
 #include "dtree.h"
+#include <type_traits>
 
 /**
  * Destructor, deletes all dynamic memory.
@@ -13,25 +14,37 @@
 DTree::~DTree() {
 
   clear(); //Deallocate memory
+}
 
-  _root = nullptr;  
+/**
+ * Copy constructor, shares every node of another DTree in O(1).
+ * @param rhs Source DTree to copy
+ */
+DTree::DTree(const DTree& rhs): _root(nullptr), _numCompactions(0), _compactThreshold(DEFAULT_COMPACT_THRESHOLD) {
+  *this = rhs;
 }
 
 /**
- * Overloaded assignment operator, makes a deep copy of a DTree.
+ * Overloaded assignment operator, makes a copy of a DTree in O(1). Both trees share
+ * every node until one of them changes, which copies only the nodes on its path.
+ * Either tree may be read, changed or destroyed on its own thread afterwards.
  * @param rhs Source DTree to copy
- * @return Deep copy of rhs
+ * @return Copy of rhs
  */
 DTree& DTree::operator=(const DTree& rhs) {
 
   if(this != &rhs) { //Guard against self asaignament
-    clear(); //deallocate memory before proceeding
+    clear(); //let go of our own nodes before proceeding
 
-    if(rhs._root != nullptr)
-      createCopy(_root, rhs._root); //call copy creator function
-    else
-      _root = nullptr;
-    
+    //shared nodes go back to the pool they came from, whichever tree drops them last
+    if(rhs._root != nullptr){
+      _pool.share(rhs._pool);
+      rhs._root->_refs.add();
+    }
+    _root = rhs._root;
+    _numCompactions = rhs._numCompactions;
+    _compactThreshold = rhs._compactThreshold;
+    _badgeCounts = rhs._badgeCounts;
   }
 
   return *this;
@@ -44,33 +57,97 @@ DTree& DTree::operator=(const DTree& rhs) {
  * @param newAcct Account object to be contained within the new DNode
  * @return true if the account was inserted, false otherwise
  */
-bool DTree::insert(Account newAcct) {
-  if(retrieve(newAcct.getDiscriminator()) != nullptr) //Make sure the data does not already exist
-    return false;
-  
-  _root = insert(newAcct, _root); //Insert the data into the tree
-  
-  return true;
+bool DTree::insert(const Account& newAcct) {
+  return tryInsert(newAcct).second;
+}
+
+/**
+ * Finds the DNode for an account's discriminator, inserting the account if it is not
+ * already live, in a single descent. A vacant node on the path is reused when the
+ * account fits between its subtrees.
+ * @param newAcct Account object to insert
+ * @return the DNode holding the discriminator and true if newAcct was inserted,
+ *         or the existing live DNode and false
+ */
+std::pair<DNode*, bool> DTree::tryInsert(const Account& newAcct) {
+  //the path may be shared with a copy, only worth copying if the account is new
+  if(_pool.isShared()){
+    DNode* existing = retrieve(newAcct.getDiscriminator(), _root);
+    if(existing != nullptr)
+      return std::make_pair(existing, false);
+  }
+
+  bool inserted = false;
+  DNode* slot = tryInsert(newAcct, _root, nullptr, false, inserted);
+  if(inserted)
+    countBadge(newAcct._badge, 1);
+  return std::make_pair(slot, inserted);
+}
+
+/**
+ * Builds an account from its fields and inserts it like tryInsert(). The strings are
+ * interned straight from the views, so an existing username or status costs no allocation.
+ * @param username account username
+ * @param disc account discriminator
+ * @param nitro whether the account has nitro
+ * @param badge badge name, empty for none
+ * @param status account status
+ * @return the DNode holding the discriminator and true if the account was inserted,
+ *         or the existing live DNode and false
+ */
+std::pair<DNode*, bool> DTree::emplace(std::string_view username, int disc, bool nitro,
+                                       std::string_view badge, std::string_view status) {
+  return tryInsert(Account(username, disc, nitro, badge, status));
+}
+
+/**
+ * Replaces the contents of the tree with a perfectly balanced tree of the given accounts.
+ * @param accounts accounts sorted by strictly increasing discriminator
+ * @param count number of accounts
+ */
+void DTree::bulkLoad(const Account accounts[], int count) {
+  for(int i = 1; i < count; i++)
+    if(accounts[i-1].getDiscriminator() >= accounts[i].getDiscriminator())
+      throw std::invalid_argument("Bulk load requires accounts sorted by unique discriminator");
+
+  clear();
+  _root = buildBalanced(accounts, 0, count - 1);
+  for(int i = 0; i < count; i++)
+    countBadge(accounts[i]._badge, 1);
+}
+
+/**
+ * Appends every live account in the tree, in discriminator order.
+ * @param accounts vector to append the accounts to
+ */
+void DTree::collectAccounts(std::vector<Account>& accounts) const {
+  collectAccounts(_root, accounts);
 }
 
 /**
  * Removes the specified DNode from the tree.
  * @param disc discriminator to match
- * @param removed DNode object to hold removed account
+ * @param removed Account object to hold the removed account
  * @return true if an account was removed, false otherwise
  */
-bool DTree::remove(int disc, DNode*& removed) {
-  if(retrieve(disc) == nullptr)  //make sure the data exists in the tree before attempting to remove it
+bool DTree::remove(int disc, Account& removed) {
+  //the path may be shared with a copy, only worth copying if the account is live
+  if(_pool.isShared() && retrieve(disc, _root) == nullptr)
     return false;
-  
-  DNode* temp = retrieve(disc); //Retrieve the data to be removed
-  
-  removed = remover(disc, _root); //call remover function to remove data
-  removed = temp; //set removed to the data removed
-
+  if(!remover(disc, _root, removed)) //single descent, fails if the account is not live
+    return false;
+  countBadge(removed._badge, -1);
   return true;
 }
 
+/**
+ * Sets the vacant ratio above which a subtree of this tree is rebuilt without its vacant nodes.
+ * @param threshold fraction of vacant nodes that triggers compaction, 1.0 or more disables it
+ */
+void DTree::setCompactThreshold(double threshold) {
+  _compactThreshold = threshold;
+}
+
 /**
  * Retrieves the specified Account within a DNode.
  * @param disc discriminator int to search for
@@ -80,11 +157,45 @@ DNode* DTree::retrieve(int disc) {
   return retrieve(disc, _root); //call retrieve function 
 }
 
+#ifdef HAVE_COROUTINE_LOOKUPS
+/**
+ * Retrieves a live account like retrieve(), suspending after the prefetch of every
+ * node on the path so a scheduler can run other lookups while it arrives.
+ * @param disc discriminator to match
+ * @return lookup yielding the DNode with a matching discriminator, nullptr otherwise
+ */
+Lookup<DNode*> DTree::retrieveAsync(int disc) const {
+  DNode* node = _root;
+  co_await Prefetch{node};
+  while(node != nullptr){
+    int nodeDisc = node->_account.getDiscriminator();
+    if(nodeDisc == disc)
+      co_return (node->_vacant ? nullptr : node);
+
+    node = (disc < nodeDisc ? node->_left : node->_right);
+    co_await Prefetch{node};
+  }
+  co_return nullptr;
+}
+#endif
+
 /**
  * Helper for the destructor to clear dynamic memory.
  */
 void DTree::clear() {  
-  clear(_root); 
+  if(_pool.isShared()){
+    //nodes a copy still links to stay, the rest go back to the shared pool
+    release(_root);
+    _pool.detach();
+  }
+  else{
+    //nodes only need to be visited if they own resources of their own
+    if(!std::is_trivially_destructible<DNode>::value)
+      clear(_root); 
+    _pool.release(); //free every slab at once
+  }
+  _root = nullptr;
+  _badgeCounts.clear();
 }
 
 /**
@@ -106,11 +217,186 @@ void DTree::dump(DNode* node) const {
     cout << ")";
 }
 
+/**
+ * Finds the live account at a position in discriminator order, skipping vacant nodes.
+ * @param k zero-based position among the live accounts
+ * @return DNode holding the k-th live account, nullptr if k is out of range
+ */
+DNode* DTree::select(int k) const {
+  DNode* node = _root;
+  while(node != nullptr) {
+    int leftLive = (node->_left == nullptr ? 0 : node->_left->getNumLive());
+    if(k < leftLive)
+      node = node->_left;
+    else{
+      if(k == leftLive && node->_vacant == false)
+        return node;
+      //skip the left subtree and this node, vacant subtrees contribute nothing
+      k -= leftLive + (node->_vacant ? 0 : 1);
+      node = node->_right;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Counts the live accounts ordered before a discriminator.
+ * @param disc discriminator to rank, which does not have to be in the tree
+ * @return number of live accounts with a smaller discriminator
+ */
+int DTree::rank(int disc) const {
+  int count = 0;
+  DNode* node = _root;
+  while(node != nullptr) {
+    if(disc <= node->getDiscriminator())
+      node = node->_left;
+    else{
+      count += (node->_left == nullptr ? 0 : node->_left->getNumLive()) + (node->_vacant ? 0 : 1);
+      node = node->_right;
+    }
+  }
+  return count;
+}
+
+/**
+ * Counts the live accounts with a discriminator in [lo, hi].
+ * @param lo smallest discriminator to count
+ * @param hi largest discriminator to count
+ * @return number of live accounts in the range
+ */
+int DTree::countInRange(int lo, int hi) const {
+  if(lo > hi)
+    return 0;
+  return rank(hi + 1) - rank(lo);
+}
+
+/**
+ * Counts the accounts with a badge, through the counts kept per badge in use.
+ * @param badge badge name, empty for accounts without a badge
+ * @return number of live accounts with the badge
+ */
+int DTree::getNumWithBadge(std::string_view badge) const {
+  int badgeId = BadgeDictionary::find(badge);
+  if(badgeId < 0)
+    return 0;
+
+  //accounts without a badge are the ones no other badge counts
+  int numOther = 0;
+  for(const std::pair<int, int>& badgeCount : _badgeCounts){
+    if(badgeCount.first == badgeId)
+      return badgeCount.second;
+    numOther += badgeCount.second;
+  }
+  return (badgeId == NO_BADGE ? getNumUsers() - numOther : 0);
+}
+
+/**
+ * Counts the nitro accounts with a discriminator in [lo, hi].
+ * @param lo smallest discriminator to count
+ * @param hi largest discriminator to count
+ * @return number of live nitro accounts in the range
+ */
+int DTree::numNitroInRange(int lo, int hi) const {
+  if(lo > hi)
+    return 0;
+  auto nitro = [](const DNode* node) {return node->_numNitro;};
+  return countBefore(hi + 1, nitro) - countBefore(lo, nitro);
+}
+
+/**
+ * Counts the accounts with a badge and a discriminator in [lo, hi], by visiting the
+ * live accounts of the range, O(log n + k) for k accounts in it.
+ * @param badge badge name, empty for accounts without a badge
+ * @param lo smallest discriminator to count
+ * @param hi largest discriminator to count
+ * @return number of live accounts with the badge in the range
+ */
+int DTree::numWithBadgeInRange(std::string_view badge, int lo, int hi) const {
+  int badgeId = BadgeDictionary::find(badge);
+  if(lo > hi || badgeId < 0)
+    return 0;
+  int count = 0;
+  for(DNode* node : range(lo, hi))
+    count += (node->_account._badge == badgeId);
+  return count;
+}
+
+/**
+ * Sums a subtree counter over the live accounts ordered before a discriminator, the way
+ * rank() sums live counts. A node's own share is its count minus its children's.
+ * @param disc discriminator to count up to, exclusive
+ * @param count callable returning the counter of a subtree root
+ * @return the counter summed over accounts with a smaller discriminator
+ */
+template <class Count>
+int DTree::countBefore(int disc, Count count) const {
+  int total = 0;
+  DNode* node = _root;
+  while(node != nullptr) {
+    if(disc <= node->getDiscriminator())
+      node = node->_left;
+    else{
+      //everything in this subtree except the right child is below disc
+      total += count(node) - (node->_right == nullptr ? 0 : count(node->_right));
+      node = node->_right;
+    }
+  }
+  return total;
+}
+
+/**
+ * Finds an unused discriminator by its position among the free ones, in one descent.
+ * Below a node's discriminator d, (d - MIN_DISC) minus the live accounts under d are free,
+ * so the live counts already kept for select() tell which side the k-th free slot is on.
+ * Vacant nodes are not live, so their discriminators count as free.
+ * @param k zero-based position among the free discriminators
+ * @return the k-th smallest free discriminator, INVALID_DISC if k is out of range
+ */
+int DTree::selectFree(int k) const {
+  if(k < 0 || k >= getNumFree())
+    return INVALID_DISC;
+
+  int liveBefore = 0; //live accounts below the subtree being searched
+  DNode* node = _root;
+  while(node != nullptr) {
+    int leftLive = (node->_left == nullptr ? 0 : node->_left->getNumLive());
+    int freeBelow = (node->getDiscriminator() - MIN_DISC) - (liveBefore + leftLive);
+    if(k < freeBelow)
+      node = node->_left;
+    else{
+      liveBefore += leftLive + (node->_vacant ? 0 : 1);
+      node = node->_right;
+    }
+  }
+  //every discriminator below the answer is either live or one of the k free ones before it
+  return MIN_DISC + liveBefore + k;
+}
+
+/**
+ * Reports the shape of the tree and the process-wide DTree counters.
+ * Walks every node, so it costs O(n).
+ * @return node and vacancy counts, height, depth histogram of live accounts and bytes allocated
+ */
+DTreeStats DTree::stats() const {
+  DTreeStats stats;
+  stats.numLive = getNumUsers();
+  stats.numVacant = (_root == nullptr ? 0 : _root->_numVacant);
+  stats.numNodes = stats.numLive + stats.numVacant;
+  stats.vacantRatio = (stats.numNodes == 0 ? 0 : static_cast<double>(stats.numVacant) / stats.numNodes);
+  stats.numCompactions = _numCompactions;
+  stats.bytesAllocated = _pool.getBytesAllocated();
+  addDepths(_root, 1, stats);
+  stats.counters = StatsRegistry::total(DTREE_COUNTERS);
+  return stats;
+}
+
 /**
  * Returns the number of valid users in the tree.
  * @return number of non-vacant nodes
  */
 int DTree::getNumUsers() const {
+  if(_root == nullptr)
+    return 0;
   return (_root->_size - _root->_numVacant); //return size of root minus vacant for number of users    
 }
 
@@ -154,6 +440,20 @@ void DTree::updateNumVacant(DNode* node) {
   node->_numVacant = i;
 }
 
+/**
+ * Updates the nitro count of a node from its own account and its children
+ * @param node DNode object in which the count will be updated
+ */
+void DTree::updateCounts(DNode* node) {
+  if(node == nullptr)
+    return;
+
+  node->countOwn();
+  for(DNode* child : {node->_left, node->_right})
+    if(child != nullptr)
+      node->_numNitro += child->_numNitro;
+}
+
 /**
  * Checks for an imbalance, defined by 'Discord' rules, at the specified node.
  * @param checkImbalance DNode object to inspect for an imbalance
@@ -162,6 +462,7 @@ void DTree::updateNumVacant(DNode* node) {
 bool DTree::checkImbalance(DNode* node) {
   if(node == nullptr) //if noes itself is empty no need for cheching for imbalance
     return false;
+  STATS(StatsRegistry::local(DTREE_COUNTERS).imbalanceChecks += 1);
 
   bool imbalance = false;     
   double difference = 0.0;
@@ -195,10 +496,8 @@ bool DTree::checkImbalance(DNode* node) {
 }
 
   //evaluatwe criarteria of imbalance and set impalance to true if crateria is met
-  if((rightSize >= 4.0 || leftSize >= 4.0) && differenceRate >= 0.5){
+  if((rightSize >= 4.0 || leftSize >= 4.0) && differenceRate >= 0.5)
     imbalance = true;
-    resetArrayMigration();  
-  }
 
   return imbalance;
 }
@@ -211,34 +510,17 @@ bool DTree::checkImbalance(DNode* node) {
 void DTree::rebalance(DNode*& node) {
   if(node == nullptr) //no nooed for rebalancing if node is empty
     return;
+  STATS(StatsRegistry::local(DTREE_COUNTERS).recordRebalance(node->_size));
 
-  return;
-
-  //create an array from data inside the bst tree
-  int arraySize = (node->getSize()-node->_numVacant);
-  Account allAccounts[arraySize];
-  convertToArray(node, allAccounts);
-
-  //dismantle the bst tree after extracting data from it
-  clear(node);
-  node = nullptr;
-
-  //sort array from smallet to largest
-  Account temp;
-  for(int i = 0; i < arraySize; i++){
-     for(int c = 0; c < arraySize; c++){
-      if(allAccounts[i].getDiscriminator() < allAccounts[c].getDiscriminator()){
-	temp = allAccounts[i];
-	allAccounts[i] = allAccounts[c];
-	allAccounts[c] = temp;
-      }
-    }
-  }
+  //collect the live nodes in order, the vacant ones are freed and shared ones copied on the way
+  //the buffer is kept per thread so steady-state rebuilds do not allocate
+  static thread_local std::vector<DNode*> liveNodes;
+  liveNodes.clear();
+  liveNodes.reserve(node->_size - node->_numVacant);
+  flatten(node, liveNodes);
 
-  //add data back to bst
-  node = arrayToBalancedBST(allAccounts, 0, arraySize, node, arraySize);
- 
-  return;
+  //relink the same nodes into a perfectly balanced subtree
+  node = buildBalanced(liveNodes, 0, static_cast<int>(liveNodes.size()) - 1);
 }
 
 // -- OR --
@@ -268,138 +550,178 @@ ostream& operator<<(ostream& sout, const Account& acct) {
     return sout;
 }
 
-void DTree::createCopy(DNode* node, DNode* copyNode){
-    if(copyNode == nullptr) return;
-
-    //go through the bst tree and create copies
-    createCopy(node->_left, copyNode->_left);
-    node = new DNode(copyNode->_account);
-    node->_size = copyNode->_size;
-    node->_numVacant = copyNode->_numVacant;
-    node->_vacant = copyNode->_vacant;
-    createCopy(node->_right, copyNode->_right);
-
-}
-
-DNode* DTree::insert(Account newAcct, DNode*& node){
-  if(node != nullptr){ //if node is not empty, add data
-    //check if data is less than the root
-    if(newAcct.getDiscriminator() < node->_account.getDiscriminator()){
-      //if data is node is vacant and if able to take data, insert data
-      if(node->_vacant == true && vacantInsertEligibility(node, newAcct.getDiscriminator())){
-	node->_account = newAcct;
-	node->_vacant = false;
-	updateNumVacant(node);
-	return node;
-       }
-      else{
-	//move left if data is less than the root
-        node->_left = insert(newAcct, node->_left);
-	updateSize(node);
-	updateNumVacant(node);
-	if(checkImbalance(node))
-	  rebalance(node);
-	 return node;
-      }
-    }
-    else{
-      //check if data is more than the root
-      if(newAcct.getDiscriminator() > node->_account.getDiscriminator()){
-	 //if data is node is vacant and if able to take data, insert data 
-	if(node->_vacant == true && vacantInsertEligibility(node, newAcct.getDiscriminator())){
-	  node->_account = newAcct;
-	  node->_vacant = false;
-	  updateNumVacant(node);
-	  return node;
-	}
-	else{
-	  //move right if data is more than the root
-	  node->_right = insert(newAcct, node->_right);
-	  updateSize(node);
-	  updateNumVacant(node);
-	  if(checkImbalance(node))
-	    rebalance(node);
-	  return node;
-	}
-      }
-    }
-  }
-  else{
-    //allocate memory and add data to it if an emoty node is found
-    DNode* node = new DNode(newAcct);
-    updateSize(node);
+DNode* DTree::own(DNode*& node){
+  if(node == nullptr || !isShared(node))
     return node;
+
+  //the copy takes over our link to the node, its children gain a link from the copy
+  DNode* copy = _pool.create(*node);
+  if(copy->_left != nullptr)
+    copy->_left->_refs.add();
+  if(copy->_right != nullptr)
+    copy->_right->_refs.add();
+  release(node);
+  node = copy;
+  return node;
+}
+
+void DTree::countBadge(int badgeId, int delta){
+  //a tree rarely holds more than a few badges, so a short unsorted list beats a map
+  if(badgeId == NO_BADGE)
+    return;
+  for(size_t i = 0; i < _badgeCounts.size(); i++){
+    if(_badgeCounts[i].first != badgeId)
+      continue;
+    _badgeCounts[i].second += delta;
+    if(_badgeCounts[i].second == 0){
+      _badgeCounts[i] = _badgeCounts.back();
+      _badgeCounts.pop_back();
+    }
+    return;
   }
-  return nullptr;
+  _badgeCounts.emplace_back(badgeId, delta);
 }
 
-DNode* DTree::remover(int disc, DNode*& node){
-  if(node == nullptr)
-    return nullptr;
+void DTree::release(DNode* node){
+  //a node goes back to the pool once no tree or parent links to it
+  if(node == nullptr || !node->_refs.drop())
+    return;
+  release(node->_left);
+  release(node->_right);
+  _pool.destroy(node);
+}
 
-  //recursivly cal; function to get to the data to be removed
-  node->_left = remover(disc, node->_left);
-  node->_right = remover(disc, node->_right);
+DNode* DTree::tryInsert(const Account& newAcct, DNode*& node, DNode* candidate, bool candidateGoesRight, bool& inserted){
+  if(node == nullptr){
+    inserted = true;
+    //the vacant candidate still fits, so no new node is needed
+    if(candidate != nullptr){
+      candidate->_account = newAcct;
+      candidate->_vacant = false;
+      return candidate;
+    }
+    node = _pool.create(newAcct);
+    return node;
+  }
 
-  if(node->_account.getDiscriminator() == disc &&
-     node->_left == nullptr && node->_right == nullptr){
-    node->_vacant = true;
+  own(node); //every node on the path is changed below, so none can stay shared with a copy
+  int disc = newAcct.getDiscriminator();
+  if(disc == node->getDiscriminator()){
+    if(node->_vacant == false)
+      return node; //already live, leave it untouched
+
+    node->_account = newAcct;
+    node->_vacant = false;
+    inserted = true;
     updateNumVacant(node);
+    updateCounts(node);
     return node;
   }
 
-  updateNumVacant(node);
-  return node;
+  //a vacant node can take the account only if every later step goes toward it,
+  //i.e. the account is larger than its whole left subtree or smaller than its whole right one
+  bool goRight = (disc > node->getDiscriminator());
+  if(candidate != nullptr && goRight != candidateGoesRight)
+    candidate = nullptr;
+  if(candidate == nullptr && node->_vacant == true){
+    candidate = node;
+    candidateGoesRight = !goRight;
+  }
+
+  DNode* slot = tryInsert(newAcct, (goRight ? node->_right : node->_left), candidate, candidateGoesRight, inserted);
+  if(inserted){
+    updateSize(node);
+    updateNumVacant(node);
+    updateCounts(node);
+    if(checkImbalance(node))
+      rebalance(node); //the path is our own so its nodes are relinked, not copied, and slot stays valid
+  }
+  return slot;
 }
 
-bool DTree::vacantInsertEligibility(DNode*& node, int AcctNumber){
-  //Evaluate node against data to see if it is elibale to be added in place of a vacant node
-  if(node->_account.getDiscriminator() == AcctNumber)
+bool DTree::remover(int disc, DNode*& node, Account& removed){
+  if(node == nullptr)
     return false;
-  
-  if(node->_right != nullptr && node->_left != nullptr){
-    if((node->_right->_account.getDiscriminator() > AcctNumber) && (AcctNumber > node->_left->_account.getDiscriminator()))
-      return true;
+
+  //follow the search path only, nothing off it changes or is copied
+  own(node);
+  if(disc < node->_account.getDiscriminator()){
+    if(!remover(disc, node->_left, removed))
+      return false;
   }
   else{
-    if(node->_right == nullptr && node->_left != nullptr){
-      if(node->_left->_account.getDiscriminator() < AcctNumber)
-	return true;
+    if(disc > node->_account.getDiscriminator()){
+      if(!remover(disc, node->_right, removed))
+        return false;
     }
     else{
-      if(node->_left == nullptr && node->_right != nullptr){
-      if(node->_right->_account.getDiscriminator() > AcctNumber)
+      if(node->_vacant == true)
+        return false;
+
+      //copy the account out first, the node may be freed below
+      removed = node->_account;
+
+      //a leaf can be unlinked outright, the last node stays as a tombstone so the tree keeps its username
+      if(node->_left == nullptr && node->_right == nullptr && node != _root){
+        _pool.destroy(node);
+        node = nullptr;
         return true;
       }
-      else
-	return true;
+      node->_vacant = true;
     }
   }
 
-  return false;
+  updateSize(node);
+  updateNumVacant(node);
+  updateCounts(node);
+  if(node->getNumLive() > 0 && checkImbalance(node))
+    rebalance(node);
+  else
+    compact(node);
+  return true;
+}
 
+void DTree::compact(DNode*& node){
+  //a subtree with no live accounts is left alone, the UTree drops an empty DTree as a whole
+  if(node == nullptr || node->getNumLive() == 0)
+    return;
+
+  if(node->_numVacant > _compactThreshold * node->_size){
+    rebalance(node); //the rebuild keeps only the live nodes
+    _numCompactions++;
+  }
 }
-  
+
 DNode* DTree::retrieve(int disc, DNode*& node){
-  //call function recursivly until the data that is being looked for is found
-  if(node == nullptr)
+  //walk down until the discriminator is found, counting the comparisons when stats are on
+  DNode* current = node;
+  int depth = 0;
+  while(current != nullptr){
+    depth++;
+    int nodeDisc = current->_account.getDiscriminator();
+    if(nodeDisc == disc)
+      break;
+    current = (disc < nodeDisc ? current->_left : current->_right);
+  }
+  STATS(StatsRegistry::local(DTREE_COUNTERS).recordLookup(depth));
+
+  if(current == nullptr || current->_vacant == true)
     return nullptr;
+  return current;
+}
 
-  if(node->_account.getDiscriminator() == disc){
-    if(node->_vacant == true)
-      return nullptr;
-    else
-      return node;
-  }
-  else{
-    if(node->_account.getDiscriminator() > disc)
-      return retrieve(disc, node->_left);
-    else{
-      if(node->_account.getDiscriminator() < disc)
-	return retrieve(disc, node->_right);
-    }
+void DTree::addDepths(DNode* node, int depth, DTreeStats& stats) const{
+  if(node == nullptr)
+    return;
+
+  stats.height = std::max(stats.height, depth);
+  if(node->_vacant == false){
+    if(static_cast<int>(stats.depthHistogram.size()) < depth)
+      stats.depthHistogram.resize(depth, 0);
+    stats.depthHistogram[depth - 1]++;
   }
-  return nullptr;
+  addDepths(node->_left, depth + 1, stats);
+  addDepths(node->_right, depth + 1, stats);
 }
 
 void DTree::clear(DNode* node){
@@ -408,51 +730,133 @@ void DTree::clear(DNode* node){
   else{
     clear(node->_left);
     clear(node->_right);
-    delete node;
+    node->~DNode(); //the slot itself goes back with the rest of the pool
   }
 }
 
 void DTree::printAccounts(DNode* node) const{
-  if(node == nullptr || node->_vacant == true)
+  //a vacant node can still have live accounts below it
+  if(node == nullptr || node->getNumLive() == 0)
     return;
   printAccounts(node->_left);
-  cout << node;
+  if(node->_vacant == false)
+    cout << node->getAccount() << endl;
   printAccounts(node->_right);
 }
 
-void DTree::convertToArray(DNode*& node, Account allAccounts[]){
+void DTree::flatten(DNode* node, std::vector<DNode*>& liveNodes){
   if(node == nullptr)
     return;
 
-  //only add data to array if it is not vacant
-  if(node->_vacant == false){
-    allAccounts[arrayMigration] = node->_account;
-    arrayMigration = arrayMigration + 1;
+  //a shared subtree stays intact for the copies using it, the rebuild gets copies of its live nodes
+  if(isShared(node)){
+    copyLive(node, liveNodes);
+    release(node);
+    return;
   }
-  
-  if(node->_left != nullptr)
-    convertToArray(node->_left, allAccounts);
-  if(node->_right != nullptr)
-    convertToArray(node->_right, allAccounts);
 
-  return;
+  //in order traversal keeps the nodes sorted by discriminator, so no sort is needed
+  DNode* right = node->_right;
+  flatten(node->_left, liveNodes);
+  if(node->_vacant == false)
+    liveNodes.push_back(node);
+  else
+    _pool.destroy(node);
+  flatten(right, liveNodes);
 }
 
-DNode* DTree::arrayToBalancedBST(Account allAccounts[], int start, int end, DNode*& node, int stagnent){
-  //add data to bst tree
+void DTree::copyLive(DNode* node, std::vector<DNode*>& liveNodes){
+  if(node == nullptr || node->getNumLive() == 0)
+    return;
+
+  copyLive(node->_left, liveNodes);
+  if(node->_vacant == false)
+    liveNodes.push_back(_pool.create(node->_account));
+  copyLive(node->_right, liveNodes);
+}
+
+DNode* DTree::buildBalanced(std::vector<DNode*>& liveNodes, int start, int end){
   if(start > end)
     return nullptr;
-  
-  if(end == stagnent && start == stagnent)
+
+  //middle node becomes the subtree root, the halves become its children
+  int mid = start + (end - start)/2;
+  DNode* node = liveNodes[mid];
+  node->_left = buildBalanced(liveNodes, start, mid-1);
+  node->_right = buildBalanced(liveNodes, mid+1, end);
+  updateSize(node);
+  updateNumVacant(node);
+  updateCounts(node);
+
+  return node;
+}
+
+
+DNode* DTree::buildBalanced(const Account accounts[], int start, int end){
+  if(start > end)
     return nullptr;
-  
-  int mid = (start + end)/2;
 
-  node = insert(allAccounts[mid], node); 
-  
-  node->_left = arrayToBalancedBST(allAccounts, start, mid-1, node->_left, stagnent);
-  node->_right = arrayToBalancedBST(allAccounts, mid+1, end, node->_right, stagnent);
-  
+  //nodes are taken from the pool in pre-order, so a descent walks forward through the slabs
+  int mid = start + (end - start)/2;
+  DNode* node = _pool.create(accounts[mid]);
+  node->_left = buildBalanced(accounts, start, mid-1);
+  node->_right = buildBalanced(accounts, mid+1, end);
+  updateSize(node);
+  updateCounts(node);
+
   return node;
+}
 
+void DTree::collectAccounts(DNode* node, std::vector<Account>& accounts) const{
+  if(node == nullptr)
+    return;
+
+  collectAccounts(node->_left, accounts);
+  if(node->_vacant == false)
+    accounts.push_back(node->_account);
+  collectAccounts(node->_right, accounts);
+}
+
+DRangeIterator::DRangeIterator(DNode* root, int lo, int hi): _hi(hi){
+  //keep the path to the smallest discriminator >= lo, ancestors we pass to the right are below the range
+  DNode* node = root;
+  while(node != nullptr && node->getNumLive() > 0){
+    if(node->getDiscriminator() >= lo){
+      _stack.push_back(node);
+      node = node->_left;
+    }
+    else
+      node = node->_right;
+  }
+  settle();
+}
+
+DRangeIterator& DRangeIterator::operator++(){
+  DNode* node = _stack.back();
+  _stack.pop_back();
+  pushLeftmost(node->_right);
+  settle();
+  return *this;
+}
+
+void DRangeIterator::pushLeftmost(DNode* node){
+  while(node != nullptr && node->getNumLive() > 0){
+    _stack.push_back(node);
+    node = node->_left;
+  }
+}
+
+void DRangeIterator::settle(){
+  //move past vacant nodes and stop once the range is exhausted
+  while(!_stack.empty()){
+    DNode* node = _stack.back();
+    if(node->getDiscriminator() > _hi){
+      _stack.clear();
+      return;
+    }
+    if(node->isVacant() == false)
+      return;
+    _stack.pop_back();
+    pushLeftmost(node->_right);
+  }
 }
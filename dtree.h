@@ -9,7 +9,16 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <exception>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include "nodepool.h"
+#include "strpool.h"
+#include "lookup.h"
+#include "treestats.h"
 
 using std::cout;
 using std::endl;
@@ -20,11 +29,13 @@ using std::ostream;
 #define INVALID_DISC -1
 #define MIN_DISC 0000
 #define MAX_DISC 9999
+#define UNSET_DISC 0xFFFF /* Stored form of INVALID_DISC */
 #define DEFAULT_BADGE ""
 #define DEFAULT_STATUS ""
 
 #define DEFAULT_SIZE 1
 #define DEFAULT_NUM_VACANT 0
+#define DEFAULT_COMPACT_THRESHOLD 0.25
 
 class Grader;   /* For grading purposes */
 class Tester;   /* Forward declaration for testing class */
@@ -35,39 +46,44 @@ public:
     friend class Tester;
     friend class DNode;
     friend class DTree;
+    friend class UTree;
+    friend class AccountIndex;
     Account() {
-        _username = DEFAULT_USERNAME;
-        _disc = INVALID_DISC;
+        _username = StringPool::empty();
+        _status = StringPool::empty();
+        _disc = UNSET_DISC;
+        _badge = NO_BADGE;
         _nitro = false;
-        _badge = DEFAULT_BADGE;
-        _status = DEFAULT_STATUS;
     }
 
-    Account(string username, int disc, bool nitro, string badge, string status) {
+    /* Fields are read through views and interned, so no temporary strings are built */
+    Account(std::string_view username, int disc, bool nitro, std::string_view badge, std::string_view status) {
         if(disc < MIN_DISC || disc > MAX_DISC) {
             throw std::out_of_range("Discriminator out of valid range (" + std::to_string(MIN_DISC) 
                                     + "-" + std::to_string(MAX_DISC) + ")");
         }
-        _username = username;
-        _disc = disc;
+        _username = username.empty() ? StringPool::empty() : StringPool::usernames().intern(username);
+        _status = status.empty() ? StringPool::empty() : StringPool::statuses().intern(status);
+        _disc = static_cast<uint16_t>(disc);
+        _badge = BadgeDictionary::idOf(badge);
         _nitro = nitro;
-        _badge = badge;
-        _status = status;
     }
 
     /* Getters */
-    string getUsername() const {return _username;}
-    int getDiscriminator() const {return _disc;}
+    const string& getUsername() const {return *_username;}
+    int getDiscriminator() const {return _disc == UNSET_DISC ? INVALID_DISC : _disc;}
     bool hasNitro() const {return _nitro;}
-    string getBadge() const {return _badge;}
-    string getStatus() const {return _status;}
+    const string& getBadge() const {return BadgeDictionary::nameOf(_badge);}
+    int getBadgeId() const {return _badge;}
+    const string& getStatus() const {return *_status;}
 
 private:
-    string _username;
-    int _disc;
+    /* Strings live in the shared pools, so an Account is a few handles */
+    const string* _username;
+    const string* _status;
+    uint16_t _disc;
+    uint16_t _badge;
     bool _nitro;
-    string _badge;
-    string _status;
 };
 
 /* Overloaded << operator to print Accounts */
@@ -77,6 +93,8 @@ class DNode {
     friend class Grader;
     friend class Tester;
     friend class DTree;
+    friend class UTree;
+    friend class DRangeIterator;
 
 public:
     DNode() {
@@ -85,63 +103,154 @@ public:
         _vacant = false;
         _left = nullptr;
         _right = nullptr;
+        countOwn();
     }
 
-    DNode(Account account) {
+    DNode(const Account& account) {
         _account = account;
         _size = DEFAULT_SIZE;
         _numVacant = DEFAULT_NUM_VACANT;
         _vacant = false;
         _left = nullptr;
         _right = nullptr;
+        countOwn();
     }
 
     /* Getters */
-    Account getAccount() const {return _account;}
+    const Account& getAccount() const {return _account;}
     int getSize() const {return _size;}
     int getNumVacant() const {return _numVacant;}
+    int getNumLive() const {return _size - _numVacant;}
     bool isVacant() const {return _vacant;}
-    string getUsername() const {return _account.getUsername();}
+    const string& getUsername() const {return _account.getUsername();}
     int getDiscriminator() const {return _account.getDiscriminator();}
 
+    /* Live accounts in the subtree with nitro */
+    int getNumNitro() const {return _numNitro;}
+
+    /* Shared with a copy of the tree, in which case it never changes again */
+    bool isShared() const {return _refs.isShared();}
+
 private:
+    /* A DTree never holds more than MAX_DISC + 1 nodes, so counts fit in 16 bits */
     Account _account;
-    int _size;
-    int _numVacant;
-    bool _vacant;
     DNode* _left;
     DNode* _right;
+    RefCount _refs;     /* Trees and parents linking here, a copy starts with one */
+    uint16_t _size;
+    uint16_t _numVacant;
+    bool _vacant;
+    uint16_t _numNitro;
 
     /* IMPLEMENT (optional): any other helper functions */
+
+    /* Sets the counters for a childless node, a vacant node counts nothing */
+    void countOwn() {
+        _numNitro = (!_vacant && _account._nitro ? 1 : 0);
+    }
+};
+
+/**
+ * In-order iterator over the live accounts of a DTree with discriminators in
+ * [lo, hi]. The stack holds the current node on top and the ancestors still
+ * to be visited beneath it. Subtrees without live accounts are never entered.
+ */
+class DRangeIterator {
+public:
+    DRangeIterator(): _hi(INVALID_DISC) {}
+    DRangeIterator(DNode* root, int lo, int hi);
+
+    DNode* operator*() const {return _stack.back();}
+    DNode* operator->() const {return _stack.back();}
+    DRangeIterator& operator++();
+    bool operator==(const DRangeIterator& rhs) const {return _stack.empty() == rhs._stack.empty()
+                                                              && (_stack.empty() || _stack.back() == rhs._stack.back());}
+    bool operator!=(const DRangeIterator& rhs) const {return !(*this == rhs);}
+
+private:
+    std::vector<DNode*> _stack;
+    int _hi;
+
+    void pushLeftmost(DNode* node);
+    void settle();
+};
+
+/* A [lo, hi] slice of a DTree, usable in a range-based for loop */
+class DRange {
+public:
+    DRange(DNode* root, int lo, int hi): _root(root), _lo(lo), _hi(hi) {}
+    DRangeIterator begin() const {return DRangeIterator(_root, _lo, _hi);}
+    DRangeIterator end() const {return DRangeIterator();}
+
+private:
+    DNode* _root;
+    int _lo;
+    int _hi;
 };
 
 class DTree {
     friend class Grader;
     friend class Tester;
+    friend class UTree;
 
 public:
-    DTree(): _root(nullptr) {}
+    DTree(): _root(nullptr), _numCompactions(0), _compactThreshold(DEFAULT_COMPACT_THRESHOLD) {}
 
     /* IMPLEMENT: destructor and assignment operator*/
     ~DTree();
+    /* Copies share every node with the source and path-copy them on change, so copying is O(1) */
+    DTree(const DTree& rhs);
     DTree& operator=(const DTree& rhs);
 
     /* IMPLEMENT: Basic operations */
 
-    bool insert(Account newAcct);
-    bool remove(int disc, DNode*& removed);
+    bool insert(const Account& newAcct);
+    std::pair<DNode*, bool> tryInsert(const Account& newAcct);
+    std::pair<DNode*, bool> emplace(std::string_view username, int disc, bool nitro,
+                                    std::string_view badge, std::string_view status);
+    void bulkLoad(const Account accounts[], int count);
+    void collectAccounts(std::vector<Account>& accounts) const;
+    bool remove(int disc, Account& removed);
     DNode* retrieve(int disc);
     void clear();
     void printAccounts() const;
     void dump() const {dump(_root);}
     void dump(DNode* node) const;
 
+    /* Tombstone compaction */
+
+    void setCompactThreshold(double threshold);
+    double getCompactThreshold() const {return _compactThreshold;}
+    int getNumCompactions() const {return _numCompactions;}
+
+    /* Shape and counters, for finding out why lookups are slow */
+    DTreeStats stats() const;
+
+    /* Order statistics over live accounts */
+
+    DNode* select(int k) const;
+    int rank(int disc) const;
+    int countInRange(int lo, int hi) const;
+    int getNumNitro() const {return (_root == nullptr ? 0 : _root->_numNitro);}
+    int getNumWithBadge(std::string_view badge) const;
+    int numNitroInRange(int lo, int hi) const;
+    int numWithBadgeInRange(std::string_view badge, int lo, int hi) const;
+    int selectFree(int k) const;
+    int getNumFree() const {return (MAX_DISC - MIN_DISC + 1) - getNumUsers();}
+    DRange range(int lo, int hi) const {return DRange(_root, lo, hi);}
+
+#ifdef HAVE_COROUTINE_LOOKUPS
+    /* retrieve() as a coroutine that suspends after prefetching each node, see LookupScheduler */
+    Lookup<DNode*> retrieveAsync(int disc) const;
+#endif
+
     /* IMPLEMENT: "Helper" functions */
     
     int getNumUsers() const;
-    string getUsername() const {return _root->getUsername();}
+    const string& getUsername() const {return _root->getUsername();}
     void updateSize(DNode* node);
     void updateNumVacant(DNode* node);
+    void updateCounts(DNode* node);
     bool checkImbalance(DNode* node);
     //----------------
   void rebalance(DNode*& node);
@@ -151,17 +260,29 @@ public:
 
 private:
     DNode* _root;
+    SharedNodePool<DNode> _pool; /* Owns every DNode in this tree, shared with its copies */
+    int _numCompactions;
+    double _compactThreshold;  /* Per tree, so trees on different threads can be tuned apart */
+    std::vector<std::pair<int, int>> _badgeCounts; /* (badge id, live accounts) for every badge in use but the default */
  
     /* IMPLEMENT (optional): any additional helper functions here */
-  int arrayMigration = 0;
-  void resetArrayMigration(){ arrayMigration = 0;}
-  void createCopy(DNode* node, DNode* copyNode);
-  DNode* insert(Account newAcct, DNode*& node);
-  bool vacantInsertEligibility(DNode*& node, int AcctNumber);
+  /* Nodes can only be shared while the pool is, which saves the atomic load in trees never copied */
+  bool isShared(const DNode* node) const {return _pool.isShared() && node->_refs.isShared();}
+  DNode* own(DNode*& node);
+  void release(DNode* node);
+  void countBadge(int badgeId, int delta);
+  void addDepths(DNode* node, int depth, DTreeStats& stats) const;
+  template <class Count>
+  int countBefore(int disc, Count count) const;
+  DNode* tryInsert(const Account& newAcct, DNode*& node, DNode* candidate, bool candidateGoesRight, bool& inserted);
   DNode* retrieve(int disc, DNode*& node);
-  DNode* remover(int disc, DNode*& node);
+  bool remover(int disc, DNode*& node, Account& removed);
+  void compact(DNode*& node);
   void clear(DNode* node);
   void printAccounts(DNode* node) const;
-  void convertToArray(DNode*& node, Account allAccounts[]);
-  DNode* arrayToBalancedBST(Account allAccounts[], int start, int end, DNode*& node, int stagnent);
+  void flatten(DNode* node, std::vector<DNode*>& liveNodes);
+  void copyLive(DNode* node, std::vector<DNode*>& liveNodes);
+  DNode* buildBalanced(std::vector<DNode*>& liveNodes, int start, int end);
+  DNode* buildBalanced(const Account accounts[], int start, int end);
+  void collectAccounts(DNode* node, std::vector<Account>& accounts) const;
 };
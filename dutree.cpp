@@ -0,0 +1,187 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * DurableUTree.cpp
+ * Implementation for the DurableUTree class.
+ */
+
+#include "dutree.h"
+
+/**
+ * Loads the base snapshot, if there is one, and replays the journal on top of it.
+ * Missing files are created empty. A compaction interrupted by a crash is finished.
+ * @param basePath snapshot holding every account as of the last compaction
+ * @param journalPath journal of the mutations since
+ * @param options when writes return, see JournalOptions
+ */
+void DurableUTree::open(const string& basePath, const string& journalPath, const JournalOptions& options) {
+  close();
+  std::lock_guard<std::mutex> guard(_treeLock);
+  _basePath = basePath;
+  _journalPath = journalPath;
+  _options = options;
+  _tree.clear();
+  uint64_t baseGeneration = 0;
+  if(access(basePath.c_str(), F_OK) == 0)
+    baseGeneration = _tree.loadSnapshot(basePath);
+
+  //the base names the first journal generation it does not hold, so a journal left
+  //behind by a crash after the base was written is skipped rather than replayed on top
+  _numReplayed = Journal::replay(journalPath, _tree, baseGeneration, _numDropped);
+  string nextPath = journalPath + JOURNAL_NEXT_SUFFIX;
+  if(access(nextPath.c_str(), F_OK) == 0) {
+    //records logged during an interrupted compaction, newer than the journal
+    size_t nextDropped;
+    _numReplayed += Journal::replay(nextPath, _tree, baseGeneration, nextDropped);
+    _numDropped += nextDropped;
+    fold(std::max(baseGeneration, Journal::generationOf(nextPath)) + 1);
+    return;
+  }
+
+  _journal.open(journalPath, options, false, baseGeneration);
+  if(_journal.getGeneration() < baseGeneration)
+    _journal.open(journalPath, options, true, baseGeneration); //stale, every record is in the base
+}
+
+/**
+ * Folds the journal into a new base snapshot and empties it. The snapshot is
+ * written from a copy of the tree, so writers only wait while the copy is taken
+ * and the journal is switched to a new file of the next generation. The base is
+ * saved with that generation, so a crash at any point leaves files that open()
+ * recovers every committed mutation from, and only those.
+ */
+void DurableUTree::compact() {
+  std::lock_guard<std::mutex> compacting(_compactLock);
+  string nextPath = _journalPath + JOURNAL_NEXT_SUFFIX;
+  UTree base;
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> guard(_treeLock);
+    if(!_journal.isOpen())
+      throw std::invalid_argument("DurableUTree is not open");
+    if(_journal.getPath() == nextPath) {
+      //a compaction failed after switching journals, its file cannot be switched to again
+      fold(_journal.getGeneration() + 1);
+      return;
+    }
+    base = _tree;
+    _journal.rotate(nextPath);
+    generation = _journal.getGeneration();
+  }
+
+  //until the new base is durable the old journal is still needed, only then
+  //does the journal written meanwhile replace it
+  base.saveSnapshot(_basePath, generation, true);
+  _journal.rename(_journalPath);
+}
+
+/**
+ * Syncs the journal and closes it. The tree stays readable.
+ */
+void DurableUTree::close() {
+  std::lock_guard<std::mutex> compacting(_compactLock);
+  _journal.close();
+}
+
+/**
+ * Retrieves a copy of the account with a matching username and discriminator.
+ * @param username username to match
+ * @param disc discriminator to match
+ * @param found Account object to hold the matching account
+ * @return true if a matching account was found, false otherwise
+ */
+bool DurableUTree::retrieveUser(std::string_view username, int disc, Account& found) const {
+  std::lock_guard<std::mutex> guard(_treeLock);
+  DNode* node = _tree.retrieveUser(username, disc);
+  if(node == nullptr)
+    return false;
+  found = node->getAccount();
+  return true;
+}
+
+/**
+ * Returns the number of users with a specific username.
+ * @param username username to match
+ * @return number of users with the specified username
+ */
+int DurableUTree::numUsers(std::string_view username) const {
+  std::lock_guard<std::mutex> guard(_treeLock);
+  return _tree.numUsers(username);
+}
+
+/**
+ * Returns a copy of the tree for longer reads, taken in constant time. Later
+ * writes do not show in it.
+ * @return copy of the tree, without indexes
+ */
+UTree DurableUTree::snapshot() const {
+  std::lock_guard<std::mutex> guard(_treeLock);
+  return _tree;
+}
+
+/**
+ * Inserts an account and waits until its record is durable.
+ * @param newAcct Account object to insert
+ * @return true if the account was inserted, false otherwise
+ */
+bool DurableUTree::insert(const Account& newAcct) {
+  uint64_t lsn;
+  {
+    std::lock_guard<std::mutex> guard(_treeLock);
+    if(!_journal.isOpen())
+      throw std::invalid_argument("DurableUTree is not open");
+    if(!_tree.insert(newAcct))
+      return false;
+    lsn = _journal.append(JOURNAL_INSERT, newAcct);
+  }
+  //the tree lock is free while this waits, so the next writers join the group
+  _journal.commit(lsn);
+  return true;
+}
+
+/**
+ * Removes a user with a matching username and discriminator and waits until its
+ * record is durable.
+ * @param username username to match
+ * @param disc discriminator to match
+ * @param removed Account object to hold the removed account
+ * @return true if an account was removed, false otherwise
+ */
+bool DurableUTree::removeUser(std::string_view username, int disc, Account& removed) {
+  uint64_t lsn;
+  {
+    std::lock_guard<std::mutex> guard(_treeLock);
+    if(!_journal.isOpen())
+      throw std::invalid_argument("DurableUTree is not open");
+    if(!_tree.removeUser(username, disc, removed))
+      return false;
+    lsn = _journal.append(JOURNAL_REMOVE, removed);
+  }
+  _journal.commit(lsn);
+  return true;
+}
+
+/**
+ * Sources a .csv file into the tree, then compacts so the import lands in the base
+ * rather than as one record per account. The import is not durable until this returns,
+ * and a crash before then recovers the tree without it.
+ * @param infile path to .csv file containing database of accounts
+ * @param append true to append to the existing accounts or false to clear before importing
+ */
+void DurableUTree::loadData(const string& infile, bool append) {
+  {
+    std::lock_guard<std::mutex> guard(_treeLock);
+    if(!_journal.isOpen())
+      throw std::invalid_argument("DurableUTree is not open");
+    _tree.loadData(infile, append, true);
+  }
+  compact();
+}
+
+void DurableUTree::fold(uint64_t generation){
+  //called with the tree lock held, once the base is durable no journal is needed;
+  //journals left by a crash before they are emptied are older than the base and skipped
+  _tree.saveSnapshot(_basePath, generation, true);
+  _journal.open(_journalPath, _options, true, generation);
+  std::remove((_journalPath + JOURNAL_NEXT_SUFFIX).c_str());
+}
@@ -0,0 +1,61 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * DurableUTree.h
+ * A UTree whose mutations survive a crash, kept as a base snapshot plus a journal.
+ */
+
+#pragma once
+
+#include "journal.h"
+
+#define JOURNAL_NEXT_SUFFIX ".next"  /* Journal a compaction writes to until its base is durable */
+
+/**
+ * UTree backed by two files: a base snapshot and a journal of every insert and
+ * removal made since. Opening loads the base and replays the journal on top.
+ * A mutation is applied under the tree lock, logged, and committed once the
+ * lock is released, so writers on other threads share each sync. Compaction
+ * folds the journal into a new base while writers carry on.
+ */
+class DurableUTree {
+public:
+    DurableUTree(): _numReplayed(0), _numDropped(0) {}
+
+    DurableUTree(const DurableUTree&) = delete;
+    DurableUTree& operator=(const DurableUTree&) = delete;
+
+    void open(const string& basePath, const string& journalPath, const JournalOptions& options = JournalOptions());
+    void compact();
+    void close();
+
+    /* Readers, safe from any number of threads */
+
+    bool retrieveUser(std::string_view username, int disc, Account& found) const;
+    int numUsers(std::string_view username) const;
+    UTree snapshot() const;
+
+    /* Writers, durable once they return */
+
+    bool insert(const Account& newAcct);
+    bool removeUser(std::string_view username, int disc, Account& removed);
+    void loadData(const string& infile, bool append = true);
+
+    /* Getters */
+    size_t getNumReplayed() const {return _numReplayed;}
+    size_t getNumDropped() const {return _numDropped;}
+    uint64_t getNumSyncs() const {return _journal.getNumSyncs();}
+
+private:
+    UTree _tree;
+    mutable std::mutex _treeLock;  /* Orders mutations and their records */
+    std::mutex _compactLock;
+    Journal _journal;
+    string _basePath;
+    string _journalPath;
+    JournalOptions _options;
+    size_t _numReplayed;           /* Records replayed by the last open() */
+    size_t _numDropped;            /* Bytes of torn records the last open() cut off */
+
+    void fold(uint64_t generation);
+};
@@ -0,0 +1,405 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Journal.cpp
+ * Implementation for the Journal class.
+ */
+
+#include "journal.h"
+#include <chrono>
+#include <cerrno>
+
+Journal::~Journal() {
+  //a destructor cannot report a failed sync, call close() first to see it
+  try {
+    close();
+  } catch(const std::invalid_argument&) {
+  }
+}
+
+/**
+ * Opens a journal for appending, writing the header if the file is new or emptied.
+ * Records after a torn one would never be replayed, so an existing journal must be
+ * passed to replay() first, which cuts a torn record off.
+ * @param path journal file
+ * @param options when commits return, see JournalOptions
+ * @param truncate true to drop every record already in the file
+ * @param generation generation of the file if it is new or emptied, an existing one keeps its own
+ */
+void Journal::open(const string& path, const JournalOptions& options, bool truncate, uint64_t generation) {
+  close();
+  _fd = openFile(path, truncate, generation);
+  _generation = generation;
+  _path = path;
+  _options = options;
+  _failed = false;
+  _error = 0;
+}
+
+/**
+ * Appends a record for a mutation that has just been applied. With SYNC_EACH the
+ * record is durable on return, with SYNC_GROUP once commit() returns.
+ * @param op JOURNAL_INSERT or JOURNAL_REMOVE
+ * @param acct account inserted or removed
+ * @return number of the record, to pass to commit()
+ */
+uint64_t Journal::append(JournalOp op, const Account& acct) {
+  std::unique_lock<std::mutex> guard(_lock);
+  if(_fd < 0)
+    throw std::invalid_argument("Journal is not open");
+
+  encode(op, acct);
+  uint64_t lsn = ++_appended;
+  if(_options.sync == SYNC_EACH)
+    flush(guard, lsn);
+  else if(_pending.size() >= _options.groupBytes)
+    _filled.notify_one();
+  return lsn;
+}
+
+/**
+ * Waits until a record and every record before it are written and synced.
+ * @param lsn number returned by append()
+ */
+void Journal::commit(uint64_t lsn) {
+  std::unique_lock<std::mutex> guard(_lock);
+  flush(guard, lsn);
+}
+
+/**
+ * Writes and syncs every record appended so far.
+ */
+void Journal::sync() {
+  std::unique_lock<std::mutex> guard(_lock);
+  flush(guard, _appended);
+}
+
+/**
+ * Makes every record durable in the current file, then carries on in a new, empty
+ * one of the next generation. Record numbers continue, so commits pending across
+ * the switch still return.
+ * @param path file to continue in, replaced if it exists
+ */
+void Journal::rotate(const string& path) {
+  std::unique_lock<std::mutex> guard(_lock);
+  flush(guard, _appended);
+  uint64_t generation = _generation + 1;
+  int fd = openFile(path, true, generation);
+  ::close(_fd);
+  _fd = fd;
+  _generation = generation;
+  _path = path;
+}
+
+/**
+ * Moves the journal file, durably, while it stays open.
+ * @param path new name, replaced if it exists
+ */
+void Journal::rename(const string& path) {
+  std::lock_guard<std::mutex> guard(_lock);
+  if(std::rename(_path.c_str(), path.c_str()) != 0)
+    throw std::invalid_argument("Journal " + _path + " could not be renamed to " + path);
+  _path = path;
+  syncParent(_path);
+}
+
+/**
+ * Makes every record durable and closes the file.
+ */
+void Journal::close() {
+  std::unique_lock<std::mutex> guard(_lock);
+  if(_fd < 0)
+    return;
+
+  //the file is closed even if the last records could not be written
+  int fd = _fd;
+  try {
+    flush(guard, _appended);
+  } catch(const std::invalid_argument&) {
+    ::close(fd);
+    _fd = -1;
+    throw;
+  }
+  ::close(fd);
+  _fd = -1;
+}
+
+/**
+ * Applies the records of a journal to a UTree, in order. Replay stops at the first
+ * record that is cut short or fails its checksum, the remains of a write a crash
+ * interrupted, and cuts the file there so records appended later are replayed too.
+ * A journal older than fromGeneration is skipped whole, its records are already
+ * in the snapshot the tree was loaded from.
+ * @param path journal file, a missing one holds no records
+ * @param utree tree to apply the records to
+ * @param fromGeneration oldest generation whose records the tree does not hold
+ * @param dropped set to the number of bytes cut off the end of the file
+ * @return number of records applied
+ */
+size_t Journal::replay(const string& path, UTree& utree, uint64_t fromGeneration, size_t& dropped) {
+  dropped = 0;
+  int fd = ::open(path.c_str(), O_RDWR);
+  if(fd < 0)
+    return 0;
+  struct stat info;
+  if(fstat(fd, &info) != 0 || info.st_size == 0) {
+    ::close(fd);
+    return 0;
+  }
+
+  size_t length = static_cast<size_t>(info.st_size);
+  void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(mapped == MAP_FAILED) {
+    ::close(fd);
+    throw std::invalid_argument("Journal " + path + " could not be mapped");
+  }
+  madvise(mapped, length, MADV_SEQUENTIAL);
+  const char* begin = static_cast<const char*>(mapped);
+  const char* end = begin + length;
+
+  uint64_t generation = 0;
+  if(!readHeader(begin, length, generation)) {
+    munmap(mapped, length);
+    ::close(fd);
+    throw std::invalid_argument("Journal " + path + " is not a UTree journal of version " +
+                                std::to_string(JOURNAL_VERSION));
+  }
+  if(generation < fromGeneration) {
+    munmap(mapped, length);
+    ::close(fd);
+    return 0;
+  }
+
+  size_t applied = 0;
+  Account removed;
+  const char* cursor = begin + JOURNAL_HEADER_SIZE;
+  while(static_cast<size_t>(end - cursor) >= JOURNAL_RECORD_HEADER) {
+    uint32_t size;
+    uint64_t checksum;
+    memcpy(&size, cursor, sizeof(size));
+    memcpy(&checksum, cursor + sizeof(size), sizeof(checksum));
+    const char* payload = cursor + JOURNAL_RECORD_HEADER;
+    if(static_cast<size_t>(end - payload) < size)
+      break;
+
+    uint64_t actual = SNAPSHOT_FNV_OFFSET;
+    for(const char* byte = payload; byte < payload + size; byte++)
+      actual = (actual ^ static_cast<unsigned char>(*byte)) * SNAPSHOT_FNV_PRIME;
+    if(actual != checksum || size < 4)
+      break;
+
+    //fields are read through views into the mapping and interned by the Account
+    const char* field = payload + 4;
+    const char* payloadEnd = payload + size;
+    std::string_view strings[3];
+    bool complete = true;
+    for(std::string_view& str : strings) {
+      uint32_t strLength = 0;
+      if(static_cast<size_t>(payloadEnd - field) < sizeof(strLength)) {
+        complete = false;
+        break;
+      }
+      memcpy(&strLength, field, sizeof(strLength));
+      field += sizeof(strLength);
+      if(static_cast<size_t>(payloadEnd - field) < strLength) {
+        complete = false;
+        break;
+      }
+      str = std::string_view(field, strLength);
+      field += strLength;
+    }
+    uint16_t disc;
+    memcpy(&disc, payload + 2, sizeof(disc));
+    if(!complete || disc > MAX_DISC || (payload[0] != JOURNAL_INSERT && payload[0] != JOURNAL_REMOVE))
+      break;
+
+    if(payload[0] == JOURNAL_INSERT)
+      utree.insert(Account(strings[0], disc, payload[1] != 0, strings[1], strings[2]));
+    else
+      utree.removeUser(strings[0], disc, removed);
+    applied++;
+    cursor = payloadEnd;
+  }
+
+  size_t valid = static_cast<size_t>(cursor - begin);
+  munmap(mapped, length);
+  if(valid < length) {
+    dropped = length - valid;
+    if(ftruncate(fd, static_cast<off_t>(valid)) != 0 || fdatasync(fd) != 0) {
+      ::close(fd);
+      throw std::invalid_argument("Journal " + path + " could not be truncated");
+    }
+  }
+  ::close(fd);
+  return applied;
+}
+
+/**
+ * Reads the generation of a journal file.
+ * @param path journal file
+ * @return generation in the file's header, 0 if the file is missing or empty
+ */
+uint64_t Journal::generationOf(const string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    return 0;
+  char header[JOURNAL_HEADER_SIZE];
+  ssize_t length = pread(fd, header, sizeof(header), 0);
+  ::close(fd);
+
+  uint64_t generation = 0;
+  if(length != 0 && !readHeader(header, (length < 0 ? 0 : static_cast<size_t>(length)), generation))
+    throw std::invalid_argument("Journal " + path + " is not a UTree journal of version " +
+                                std::to_string(JOURNAL_VERSION));
+  return generation;
+}
+
+/**
+ * Returns the generation of the file the journal is appending to.
+ * @return generation
+ */
+uint64_t Journal::getGeneration() const {
+  std::lock_guard<std::mutex> guard(_lock);
+  return _generation;
+}
+
+/**
+ * Returns the number of syncs the journal has issued, fewer than its records
+ * when commits were grouped.
+ * @return number of syncs
+ */
+uint64_t Journal::getNumSyncs() const {
+  std::lock_guard<std::mutex> guard(_lock);
+  return _numSyncs;
+}
+
+void Journal::flush(std::unique_lock<std::mutex>& guard, uint64_t lsn){
+  while(_durable < lsn && !_failed){
+    if(_syncing){
+      _synced.wait(guard);
+      continue;
+    }
+
+    //lead a group, the records of everyone who commits meanwhile go out with ours
+    _syncing = true;
+    if(_options.sync == SYNC_GROUP && _options.groupDelayUs > 0)
+      _filled.wait_for(guard, std::chrono::microseconds(_options.groupDelayUs),
+                       [this]() {return _pending.size() >= _options.groupBytes;});
+    _writing.swap(_pending);
+    uint64_t upTo = _appended;
+    int fd = _fd;
+
+    guard.unlock();
+    bool written = writeAll(fd, _writing.data(), _writing.size()) && fdatasync(fd) == 0;
+    int error = errno;
+    guard.lock();
+
+    _writing.clear();
+    _syncing = false;
+    if(written){
+      _durable = upTo;
+      _numSyncs++;
+    }
+    else{
+      _failed = true;
+      _error = error;
+    }
+    _synced.notify_all();
+  }
+
+  if(_durable < lsn)
+    throw std::invalid_argument("Journal " + _path + " could not be written: " + std::strerror(_error));
+}
+
+void Journal::encode(JournalOp op, const Account& acct){
+  //the payload is built in place, then its length and checksum are filled in
+  size_t start = _pending.size();
+  _pending.resize(start + JOURNAL_RECORD_HEADER + 4);
+  char* fixed = _pending.data() + start + JOURNAL_RECORD_HEADER;
+  uint16_t disc = static_cast<uint16_t>(acct.getDiscriminator());
+  fixed[0] = static_cast<char>(op);
+  fixed[1] = (acct.hasNitro() ? 1 : 0);
+  memcpy(fixed + 2, &disc, sizeof(disc));
+
+  for(const string* str : {&acct.getUsername(), &acct.getBadge(), &acct.getStatus()}){
+    uint32_t strLength = static_cast<uint32_t>(str->size());
+    const char* lengthBytes = reinterpret_cast<const char*>(&strLength);
+    _pending.insert(_pending.end(), lengthBytes, lengthBytes + sizeof(strLength));
+    _pending.insert(_pending.end(), str->begin(), str->end());
+  }
+
+  const char* payload = _pending.data() + start + JOURNAL_RECORD_HEADER;
+  uint32_t size = static_cast<uint32_t>(_pending.size() - start - JOURNAL_RECORD_HEADER);
+  uint64_t checksum = SNAPSHOT_FNV_OFFSET;
+  for(const char* byte = payload; byte < payload + size; byte++)
+    checksum = (checksum ^ static_cast<unsigned char>(*byte)) * SNAPSHOT_FNV_PRIME;
+  memcpy(_pending.data() + start, &size, sizeof(size));
+  memcpy(_pending.data() + start + sizeof(size), &checksum, sizeof(checksum));
+}
+
+int Journal::openFile(const string& path, bool truncate, uint64_t& generation){
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0644);
+  struct stat info;
+  if(fd < 0 || fstat(fd, &info) != 0){
+    if(fd >= 0) ::close(fd);
+    throw std::invalid_argument("Journal " + path + " could not be opened");
+  }
+
+  char header[JOURNAL_HEADER_SIZE];
+  if(info.st_size > 0){
+    //an existing journal carries on in its own generation
+    ssize_t length = pread(fd, header, sizeof(header), 0);
+    if(length < 0 || !readHeader(header, static_cast<size_t>(length), generation)){
+      ::close(fd);
+      throw std::invalid_argument("Journal " + path + " is not a UTree journal of version " +
+                                  std::to_string(JOURNAL_VERSION));
+    }
+    return fd;
+  }
+
+  //a new journal is only usable once its header and name are durable
+  uint32_t version = JOURNAL_VERSION;
+  memcpy(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+  memcpy(header + sizeof(JOURNAL_MAGIC), &version, sizeof(version));
+  memcpy(header + sizeof(JOURNAL_MAGIC) + sizeof(version), &generation, sizeof(generation));
+  if(!writeAll(fd, header, sizeof(header)) || fdatasync(fd) != 0){
+    ::close(fd);
+    throw std::invalid_argument("Journal " + path + " could not be written");
+  }
+  syncParent(path);
+  return fd;
+}
+
+bool Journal::readHeader(const char* header, size_t length, uint64_t& generation){
+  uint32_t version = 0;
+  if(length < JOURNAL_HEADER_SIZE || memcmp(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0)
+    return false;
+  memcpy(&version, header + sizeof(JOURNAL_MAGIC), sizeof(version));
+  memcpy(&generation, header + sizeof(JOURNAL_MAGIC) + sizeof(version), sizeof(generation));
+  return version == JOURNAL_VERSION;
+}
+
+bool Journal::writeAll(int fd, const char* data, size_t length){
+  while(length > 0){
+    ssize_t written = ::write(fd, data, length);
+    if(written < 0){
+      if(errno == EINTR)
+        continue;
+      return false;
+    }
+    data += written;
+    length -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+void Journal::syncParent(const string& path){
+  size_t slash = path.rfind('/');
+  string directory = (slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash)));
+  int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if(fd < 0 || fsync(fd) != 0){
+    if(fd >= 0) ::close(fd);
+    throw std::invalid_argument("Directory " + directory + " could not be synced");
+  }
+  ::close(fd);
+}
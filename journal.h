@@ -0,0 +1,102 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Journal.h
+ * An append-only log of UTree insertions and removals, synced in groups.
+ */
+
+#pragma once
+
+#include "utree.h"
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_SIZE 20      /* Magic, u32 version and u64 generation */
+#define JOURNAL_RECORD_HEADER 12    /* u32 payload length and u64 checksum before every record */
+#define JOURNAL_GROUP_DELAY_US 0
+#define JOURNAL_GROUP_BYTES 65536
+static const char JOURNAL_MAGIC[8] = {'U', 'T', 'J', 'O', 'U', 'R', 'N', '\0'};
+
+enum JournalOp {JOURNAL_INSERT = 1, JOURNAL_REMOVE = 2};
+
+/* When commit() returns */
+enum JournalSync {
+    SYNC_EACH,   /* Every record is written and synced on its own */
+    SYNC_GROUP   /* Records appended while a sync runs share the next one */
+};
+
+struct JournalOptions {
+    JournalSync sync = SYNC_GROUP;
+    int groupDelayUs = JOURNAL_GROUP_DELAY_US;  /* How long a group waits for more records, 0 syncs at once */
+    size_t groupBytes = JOURNAL_GROUP_BYTES;    /* A waiting group syncs early once this much is pending */
+};
+
+/**
+ * Log of the mutations made to a UTree since its last snapshot. Records are
+ * appended in the order the mutations were applied and numbered from 1; a
+ * writer appends under whatever lock orders its mutations, then commits
+ * outside it. The first writer to commit becomes the leader and writes and
+ * syncs every pending record at once, writers committing meanwhile wait for
+ * it and then find their records already durable.
+ *
+ * Every journal file belongs to a generation, and a rotation starts the next
+ * one. A snapshot saved with the generation after a journal's holds all of
+ * that journal's records, so replay() can tell a stale journal from a live one.
+ *
+ * Layout, all integers in host byte order:
+ *   header   magic "UTJOURN\0", u32 version, u64 generation
+ *   records  u32 payload length, u64 FNV-1a checksum of the payload, payload:
+ *            u8 op, u8 nitro, u16 disc, then username, badge and status as u32 length, bytes
+ */
+class Journal {
+public:
+    Journal(): _fd(-1), _generation(0), _appended(0), _durable(0), _syncing(false), _failed(false), _error(0), _numSyncs(0) {}
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    void open(const string& path, const JournalOptions& options = JournalOptions(), bool truncate = false,
+              uint64_t generation = 0);
+    uint64_t append(JournalOp op, const Account& acct);
+    void commit(uint64_t lsn);
+    void sync();
+    void rotate(const string& path);
+    void rename(const string& path);
+    void close();
+
+    static size_t replay(const string& path, UTree& utree, uint64_t fromGeneration, size_t& dropped);
+    static uint64_t generationOf(const string& path);
+
+    /* Getters */
+    bool isOpen() const {return _fd >= 0;}
+    const string& getPath() const {return _path;}
+    uint64_t getGeneration() const;
+    uint64_t getNumSyncs() const;
+
+private:
+    string _path;
+    int _fd;
+    uint64_t _generation;              /* Of the file open now */
+    JournalOptions _options;
+    mutable std::mutex _lock;
+    std::condition_variable _synced;   /* A leader finished */
+    std::condition_variable _filled;   /* A waiting group has groupBytes pending */
+    std::vector<char> _pending;        /* Encoded records not written yet */
+    std::vector<char> _writing;        /* The leader's batch, kept to reuse its capacity */
+    uint64_t _appended;                /* Number of the last record appended */
+    uint64_t _durable;                 /* Number of the last record written and synced */
+    bool _syncing;                     /* A leader is writing, others wait for it */
+    bool _failed;                      /* A write or sync failed, nothing after it is durable */
+    int _error;                        /* errno of the write or sync that failed */
+    uint64_t _numSyncs;
+
+    void flush(std::unique_lock<std::mutex>& guard, uint64_t lsn);
+    void encode(JournalOp op, const Account& acct);
+    static int openFile(const string& path, bool truncate, uint64_t& generation);
+    static bool readHeader(const char* header, size_t length, uint64_t& generation);
+    static bool writeAll(int fd, const char* data, size_t length);
+    static void syncParent(const string& path);
+};
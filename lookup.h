@@ -0,0 +1,152 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * Lookup.h
+ * Coroutine lookups that suspend on every prefetch, and a scheduler that
+ * interleaves them. Only available when the compiler supports coroutines.
+ */
+
+#pragma once
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define HAVE_COROUTINE_LOOKUPS 1
+
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+/* State shared by every lookup, whatever it returns */
+struct LookupPromiseBase {
+    std::coroutine_handle<> continuation;  /* Lookup awaiting this one, empty for the outermost */
+    std::coroutine_handle<> innermost;     /* Only used in the outermost, where resumption continues */
+    std::coroutine_handle<>* resumeAt = &innermost;
+};
+
+/**
+ * Prefetches an address and suspends, so other lookups run while the line
+ * is on its way. A null address has nothing to wait for.
+ */
+struct Prefetch {
+    const void* address;
+
+    bool await_ready() const noexcept {
+        if(address == nullptr) return true;
+        __builtin_prefetch(address);
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+    void await_resume() const noexcept {}
+};
+
+/**
+ * A lookup coroutine. It starts suspended and is driven by a LookupScheduler,
+ * or by resume() until done(). Lookups may co_await other lookups, in which
+ * case resuming the outer one resumes the innermost suspended one.
+ */
+template <class T>
+class Lookup {
+public:
+    struct promise_type;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    struct promise_type: LookupPromiseBase {
+        T value{};
+
+        Lookup get_return_object() {
+            innermost = Handle::from_promise(*this);
+            return Lookup(Handle::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept {return {};}
+        void return_value(T result) {value = result;}
+        void unhandled_exception() {std::terminate();}
+
+        /* A finished inner lookup hands control straight back to the one awaiting it */
+        struct FinalAwaiter {
+            bool await_ready() const noexcept {return false;}
+            std::coroutine_handle<> await_suspend(Handle done) noexcept {
+                promise_type& promise = done.promise();
+                if(!promise.continuation) return std::noop_coroutine();
+                *promise.resumeAt = promise.continuation;
+                return promise.continuation;
+            }
+            void await_resume() const noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept {return {};}
+    };
+
+    Lookup(Lookup&& other) noexcept: _handle(other._handle) {other._handle = nullptr;}
+    Lookup& operator=(Lookup&& other) noexcept {
+        if(this != &other) {
+            if(_handle) _handle.destroy();
+            _handle = other._handle;
+            other._handle = nullptr;
+        }
+        return *this;
+    }
+    Lookup(const Lookup&) = delete;
+    Lookup& operator=(const Lookup&) = delete;
+    ~Lookup() {if(_handle) _handle.destroy();}
+
+    bool done() const {return _handle.done();}
+    void resume() {_handle.promise().innermost.resume();}
+    T result() const {return _handle.promise().value;}
+    LookupPromiseBase& promise() {return _handle.promise();}
+
+    /* Awaiting a lookup runs it inside the awaiting one */
+    bool await_ready() const noexcept {return false;}
+    template <class Outer>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Outer> outer) noexcept {
+        promise_type& inner = _handle.promise();
+        inner.continuation = outer;
+        inner.resumeAt = outer.promise().resumeAt;
+        *inner.resumeAt = _handle;
+        return _handle;
+    }
+    T await_resume() const noexcept {return _handle.promise().value;}
+
+private:
+    explicit Lookup(Handle handle): _handle(handle) {}
+
+    Handle _handle;
+};
+
+/**
+ * Round-robins a set of lookups with a bounded number in flight. Lookups of
+ * different result types can be mixed; they stay owned by the caller, who
+ * reads each result() after run().
+ */
+class LookupScheduler {
+public:
+    explicit LookupScheduler(int width): _width(width) {}
+
+    template <class T>
+    void add(Lookup<T>& lookup) {_pending.push_back(&lookup.promise());}
+
+    void run() {
+        std::vector<LookupPromiseBase*> inFlight;
+        size_t next = 0;
+        while(next < _pending.size() || !inFlight.empty()) {
+            while(static_cast<int>(inFlight.size()) < _width && next < _pending.size())
+                inFlight.push_back(_pending[next++]);
+
+            /* One step of every lookup in flight, finished ones are swapped out */
+            for(size_t i = 0; i < inFlight.size(); ) {
+                std::coroutine_handle<> step = inFlight[i]->innermost;
+                step.resume();
+                if(inFlight[i]->innermost.done()) {
+                    inFlight[i] = inFlight.back();
+                    inFlight.pop_back();
+                } else {
+                    i++;
+                }
+            }
+        }
+        _pending.clear();
+    }
+
+private:
+    int _width;
+    std::vector<LookupPromiseBase*> _pending;
+};
+
+#endif
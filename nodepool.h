@@ -0,0 +1,311 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * NodePool.h
+ * A slab allocator that owns the nodes of a single tree, and the pool and
+ * reference count used once copies of a tree share their nodes.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+#define MIN_SLAB_NODES 4
+#define MAX_SLAB_NODES 1024
+
+template <class T>
+class NodePool {
+public:
+    NodePool(): _slabs(nullptr), _free(nullptr), _used(0), _capacity(0), _nextCapacity(MIN_SLAB_NODES), _live(0) {}
+
+    ~NodePool() {release();}
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    /**
+     * Constructs a node in a free slot, reusing released slots first.
+     * @param args arguments forwarded to the node's constructor
+     * @return pointer to the new node
+     */
+    template <class... Args>
+    T* create(Args&&... args) {
+        void* slot;
+        if(_free != nullptr) {
+            slot = _free;
+            _free = _free->next;
+        } else {
+            if(_used == _capacity) grow();
+            slot = slotAt(_slabs, _used++);
+        }
+        T* node = new (slot) T(std::forward<Args>(args)...);
+        _live++;
+        return node;
+    }
+
+    /**
+     * Destroys a node and puts its slot on the free list.
+     * @param node node previously returned by create()
+     */
+    void destroy(T* node) {
+        if(node == nullptr) return;
+        node->~T();
+        FreeSlot* slot = reinterpret_cast<FreeSlot*>(node);
+        slot->next = _free;
+        _free = slot;
+        _live--;
+    }
+
+    /**
+     * Frees every slab at once. Nodes are not destructed, so the owner
+     * must destroy any node with a non-trivial destructor beforehand.
+     */
+    void release() {
+        while(_slabs != nullptr) {
+            Slab* next = _slabs->next;
+            ::operator delete(_slabs);
+            _slabs = next;
+        }
+        _free = nullptr;
+        _used = 0;
+        _capacity = 0;
+        _nextCapacity = MIN_SLAB_NODES;
+        _live = 0;
+    }
+
+    /**
+     * Takes over every slab and free slot of another pool, which is left
+     * empty. Nodes keep their addresses, so trees built in the other pool
+     * can be linked into the tree that owns this one.
+     * @param other pool to take the nodes from
+     */
+    void adopt(NodePool& other) {
+        if(&other == this || other._slabs == nullptr) return;
+
+        if(_slabs == nullptr) {
+            _slabs = other._slabs;
+            _used = other._used;
+            _capacity = other._capacity;
+            _nextCapacity = other._nextCapacity;
+        } else {
+            /* Our current slab stays at the head so allocation carries on where it was */
+            Slab* last = other._slabs;
+            while(last->next != nullptr) last = last->next;
+            last->next = _slabs->next;
+            _slabs->next = other._slabs;
+        }
+
+        if(_free == nullptr) {
+            _free = other._free;
+        } else if(other._free != nullptr) {
+            FreeSlot* last = other._free;
+            while(last->next != nullptr) last = last->next;
+            last->next = _free;
+            _free = other._free;
+        }
+        _live += other._live;
+
+        other._slabs = nullptr;
+        other._free = nullptr;
+        other._used = 0;
+        other._capacity = 0;
+        other._nextCapacity = MIN_SLAB_NODES;
+        other._live = 0;
+    }
+
+    /* Getters */
+    size_t getNumLive() const {return _live;}
+    size_t getBytesAllocated() const {
+        size_t bytes = 0;
+        for(Slab* slab = _slabs; slab != nullptr; slab = slab->next)
+            bytes += HEADER_SIZE + slab->capacity * SLOT_SIZE;
+        return bytes;
+    }
+
+private:
+    struct Slab {
+        Slab* next;
+        size_t capacity;
+    };
+
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    /* Slots are large enough to hold a node or a free list link */
+    static constexpr size_t SLOT_ALIGN = alignof(T) > alignof(FreeSlot) ? alignof(T) : alignof(FreeSlot);
+    static constexpr size_t SLOT_SIZE = ((sizeof(T) > sizeof(FreeSlot) ? sizeof(T) : sizeof(FreeSlot))
+                                         + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+    static constexpr size_t HEADER_SIZE = (sizeof(Slab) + alignof(std::max_align_t) - 1)
+                                          / alignof(std::max_align_t) * alignof(std::max_align_t);
+    static_assert(SLOT_ALIGN <= alignof(std::max_align_t), "NodePool does not support over-aligned nodes");
+
+    Slab* _slabs;       /* Most recent slab first, it is the one being filled */
+    FreeSlot* _free;
+    size_t _used;       /* Slots handed out from the current slab */
+    size_t _capacity;   /* Slots in the current slab */
+    size_t _nextCapacity;
+    size_t _live;
+
+    static void* slotAt(Slab* slab, size_t index) {
+        return reinterpret_cast<unsigned char*>(slab) + HEADER_SIZE + index * SLOT_SIZE;
+    }
+
+    /* Slabs double in size so small trees stay small and large trees stay packed */
+    void grow() {
+        Slab* slab = static_cast<Slab*>(::operator new(HEADER_SIZE + _nextCapacity * SLOT_SIZE));
+        slab->next = _slabs;
+        slab->capacity = _nextCapacity;
+        _slabs = slab;
+        _used = 0;
+        _capacity = _nextCapacity;
+        if(_nextCapacity < MAX_SLAB_NODES) _nextCapacity *= 2;
+    }
+};
+
+/**
+ * Number of trees and parent nodes linking to a node. A new node, or a copy of
+ * one, starts with the single link that created it. Counts may be dropped from
+ * any thread, so a copy of a tree can be released where it was read.
+ */
+class RefCount {
+public:
+    RefCount(): _count(1) {}
+    RefCount(const RefCount&): _count(1) {}
+    RefCount& operator=(const RefCount&) {return *this;}
+
+    void add() {__atomic_add_fetch(&_count, 1, __ATOMIC_RELAXED);}
+    /* @return true if that was the last link, so the node can be freed */
+    bool drop() {return __atomic_sub_fetch(&_count, 1, __ATOMIC_ACQ_REL) == 0;}
+    /* A shared node is read-only, it has to be copied before it can change */
+    bool isShared() const {return __atomic_load_n(&_count, __ATOMIC_ACQUIRE) > 1;}
+    uint32_t get() const {return __atomic_load_n(&_count, __ATOMIC_RELAXED);}
+
+private:
+    uint32_t _count;
+};
+
+/**
+ * The node pool of a tree whose nodes may be shared with copies of it. Until
+ * the tree is first copied the nodes live in a plain NodePool held inline; the
+ * first copy moves that pool behind a shared pointer that every copy holds, so
+ * whichever copy drops a node last can give it back. The lock is only taken
+ * while the pool is shared, an unshared pool costs what a NodePool does.
+ */
+template <class T>
+class SharedNodePool {
+public:
+    SharedNodePool() {}
+
+    SharedNodePool(const SharedNodePool&) = delete;
+    SharedNodePool& operator=(const SharedNodePool&) = delete;
+
+    template <class... Args>
+    T* create(Args&&... args) {
+        if(!isShared()) return pool().create(std::forward<Args>(args)...);
+        std::lock_guard<std::mutex> guard(_shared->lock);
+        return pool().create(std::forward<Args>(args)...);
+    }
+
+    void destroy(T* node) {
+        if(!isShared()) return pool().destroy(node);
+        std::lock_guard<std::mutex> guard(_shared->lock);
+        pool().destroy(node);
+    }
+
+    /**
+     * Frees every slab at once, like NodePool::release(). Only valid while
+     * the pool is not shared, a shared pool is left with detach() instead.
+     */
+    void release() {
+        pool().release();
+        _shared.reset();
+    }
+
+    /**
+     * Takes over the nodes of an unshared pool, like NodePool::adopt().
+     * @param other pool to take the nodes from
+     */
+    void adopt(SharedNodePool& other) {
+        if(!isShared()) return pool().adopt(other.pool());
+        std::lock_guard<std::mutex> guard(_shared->lock);
+        pool().adopt(other.pool());
+    }
+
+    /**
+     * Starts allocating from the pool of another tree, whose nodes this tree
+     * is about to share. This pool must hold no nodes. Copies of one tree may
+     * be taken on several threads at once, so moving the other pool out of
+     * line is serialized.
+     * @param other pool of the tree being copied
+     */
+    void share(const SharedNodePool& other) {
+        std::lock_guard<std::mutex> guard(sharing());
+        if(other._shared == nullptr) {
+            other._shared = std::make_shared<Shared>();
+            other._shared->pool.adopt(other._local);
+        }
+        _shared = other._shared;
+    }
+
+    /* Lets go of a shared pool, the nodes in it stay with the trees still sharing it */
+    void detach() {
+        std::lock_guard<std::mutex> guard(sharing());
+        _shared.reset();
+    }
+
+    /**
+     * A pool that was never shared is a plain test, so trees that are never
+     * copied pay nothing. Once every copy has let go the nodes move back
+     * inline, so the tree stops paying for the copies it no longer has.
+     */
+    bool isShared() const {
+        if(_shared == nullptr)
+            return false;
+        if(_shared.use_count() > 1)
+            return true;
+        //copies detach under the same lock, so their last reads of our nodes happen before this
+        std::lock_guard<std::mutex> guard(sharing());
+        _local.adopt(_shared->pool);
+        _shared.reset();
+        return false;
+    }
+
+    /* Getters, for a shared pool these cover every tree sharing it. The tree may be copied meanwhile */
+    size_t getNumLive() const {
+        std::lock_guard<std::mutex> guard(sharing());
+        if(_shared == nullptr) return _local.getNumLive();
+        std::lock_guard<std::mutex> poolGuard(_shared->lock);
+        return _shared->pool.getNumLive();
+    }
+    size_t getBytesAllocated() const {
+        std::lock_guard<std::mutex> guard(sharing());
+        if(_shared == nullptr) return _local.getBytesAllocated();
+        std::lock_guard<std::mutex> poolGuard(_shared->lock);
+        return _shared->pool.getBytesAllocated();
+    }
+
+private:
+    struct Shared {
+        NodePool<T> pool;
+        std::mutex lock;
+    };
+
+    mutable NodePool<T> _local;                 /* Used until the tree is first copied */
+    mutable std::shared_ptr<Shared> _shared;
+
+    /* Held while a pool is moved out of line, which is rare enough for one lock per node type */
+    static std::mutex& sharing() {
+        static std::mutex lock;
+        return lock;
+    }
+
+    NodePool<T>& pool() {return _shared != nullptr ? _shared->pool : _local;}
+    const NodePool<T>& pool() const {return _shared != nullptr ? _shared->pool : _local;}
+};
@@ -0,0 +1,129 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * StringPool.cpp
+ * Implementation for the StringPool and BadgeDictionary classes.
+ */
+
+#include "strpool.h"
+#include <stdexcept>
+#include <algorithm>
+
+const string* StringPool::intern(std::string_view str) {
+  Stripe& stripe = _stripes[std::hash<std::string_view>()(str) % NUM_POOL_STRIPES];
+  std::lock_guard<std::mutex> guard(stripe.lock);
+
+  auto found = stripe.index.find(str);
+  if(found != stripe.index.end())
+    return found->second;
+
+  //deque elements never move, so both the address and the key's view stay valid
+  stripe.strings.emplace_back(str);
+  const string* pooled = &stripe.strings.back();
+  stripe.index.emplace(std::string_view(*pooled), pooled);
+
+  //the string, its index node, and any heap buffer beyond the small string storage
+  stripe.bytes += sizeof(string) + sizeof(std::string_view) + 3 * sizeof(void*) +
+                  (str.size() > 15 ? pooled->capacity() + 1 : 0);
+  return pooled;
+}
+
+size_t StringPool::getNumStrings() const {
+  size_t count = 0;
+  for(const Stripe& stripe : _stripes) {
+    std::lock_guard<std::mutex> guard(stripe.lock);
+    count += stripe.strings.size();
+  }
+  return count;
+}
+
+size_t StringPool::getBytesAllocated() const {
+  size_t bytes = 0;
+  for(const Stripe& stripe : _stripes) {
+    std::lock_guard<std::mutex> guard(stripe.lock);
+    bytes += stripe.bytes + stripe.index.bucket_count() * sizeof(void*);
+  }
+  return bytes;
+}
+
+const string* StringPool::empty() {
+  static const string emptyString;
+  return &emptyString;
+}
+
+StringPool& StringPool::usernames() {
+  static StringPool pool;
+  return pool;
+}
+
+StringPool& StringPool::statuses() {
+  static StringPool pool;
+  return pool;
+}
+
+std::atomic<const string**> BadgeDictionary::_chunks[MAX_BADGES / BADGE_CHUNK];
+std::atomic<uint16_t> BadgeDictionary::_index[2 * MAX_BADGES];
+std::atomic<int> BadgeDictionary::_numBadges(0);
+std::mutex BadgeDictionary::_lock;
+
+uint16_t BadgeDictionary::idOf(std::string_view badge) {
+  //id 0 is reserved for accounts without a badge
+  if(badge.empty())
+    return NO_BADGE;
+
+  //known badges are found without the lock
+  size_t slot;
+  int id = probe(badge, slot);
+  if(id > 0)
+    return static_cast<uint16_t>(id);
+
+  std::lock_guard<std::mutex> guard(_lock);
+  id = probe(badge, slot);
+  if(id > 0)
+    return static_cast<uint16_t>(id);
+
+  int numBadges = std::max(1, _numBadges.load(std::memory_order_relaxed));
+  if(numBadges == MAX_BADGES)
+    throw std::out_of_range("Too many distinct badges (max " + std::to_string(MAX_BADGES - 1) + ")");
+
+  //the index has twice as many slots as ids, so the empty slot probe() stopped at is still free
+  std::atomic<const string**>& chunk = _chunks[numBadges / BADGE_CHUNK];
+  if(chunk.load(std::memory_order_relaxed) == nullptr)
+    chunk.store(new const string*[BADGE_CHUNK](), std::memory_order_release);
+  chunk.load(std::memory_order_relaxed)[numBadges % BADGE_CHUNK] = StringPool::statuses().intern(badge);
+  _index[slot].store(static_cast<uint16_t>(numBadges), std::memory_order_release);
+  _numBadges.store(numBadges + 1, std::memory_order_release);
+  return static_cast<uint16_t>(numBadges);
+}
+
+int BadgeDictionary::find(std::string_view badge) {
+  if(badge.empty())
+    return NO_BADGE;
+
+  size_t slot;
+  int id = probe(badge, slot);
+  return (id > 0 ? id : -1);
+}
+
+const string& BadgeDictionary::nameOf(uint16_t id) {
+  if(id == NO_BADGE)
+    return *StringPool::empty();
+  return *_chunks[id / BADGE_CHUNK].load(std::memory_order_acquire)[id % BADGE_CHUNK];
+}
+
+int BadgeDictionary::getNumBadges() {
+  int numBadges = _numBadges.load(std::memory_order_acquire);
+  return (numBadges == 0 ? 1 : numBadges);
+}
+
+int BadgeDictionary::probe(std::string_view badge, size_t& slot) {
+  //linear probing, slots are never cleared so an empty one ends the search
+  const size_t mask = 2 * MAX_BADGES - 1;
+  for(slot = std::hash<std::string_view>()(badge) & mask; ; slot = (slot + 1) & mask) {
+    uint16_t id = _index[slot].load(std::memory_order_acquire);
+    if(id == NO_BADGE)
+      return -1;
+    if(nameOf(id) == badge)
+      return id;
+  }
+}
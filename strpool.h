@@ -0,0 +1,102 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * StringPool.h
+ * Interned string storage shared by every Account.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <cstdint>
+#include <atomic>
+
+using std::string;
+
+#define MAX_BADGES 65536     /* Badge ids are 16 bits, id 0 is the default badge */
+#define BADGE_CHUNK 256      /* Names are stored in chunks that never move */
+#define NO_BADGE 0
+#define NUM_POOL_STRIPES 16
+
+class StringPool {
+public:
+    StringPool() {}
+
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    /**
+     * Returns the pooled copy of a string, adding it on first use. The
+     * returned pointer stays valid for the lifetime of the pool.
+     * Lookups of strings already in the pool do not allocate.
+     * @param str string to intern
+     * @return pointer to the single pooled copy of str
+     */
+    const string* intern(std::string_view str);
+
+    /* Getters */
+    size_t getNumStrings() const;
+    size_t getBytesAllocated() const;
+
+    /* Shared empty string, usable without taking the pool lock */
+    static const string* empty();
+
+    /* Process-wide pools */
+    static StringPool& usernames();
+    static StringPool& statuses();
+
+private:
+    /* Strings are spread over independently locked stripes so parallel loaders rarely contend */
+    struct alignas(64) Stripe {
+        std::deque<string> strings;                                /* Never moves an element */
+        std::unordered_map<std::string_view, const string*> index; /* Keys view into strings */
+        size_t bytes = 0;
+        mutable std::mutex lock;
+    };
+
+    Stripe _stripes[NUM_POOL_STRIPES];
+};
+
+class BadgeDictionary {
+public:
+    /**
+     * Returns the dense id of a badge name, assigning one on first use.
+     * @param badge badge name, DEFAULT_BADGE for none
+     * @return id in [0, MAX_BADGES), NO_BADGE for the default badge
+     * @throws std::out_of_range once MAX_BADGES - 1 distinct badges are in use
+     */
+    static uint16_t idOf(std::string_view badge);
+
+    /**
+     * Returns the badge name for an id returned by idOf().
+     * @param id badge id
+     * @return badge name
+     */
+    static const string& nameOf(uint16_t id);
+
+    /**
+     * Looks up a badge name without assigning it an id.
+     * @param badge badge name, empty for none
+     * @return id of the badge, -1 if it has never been seen
+     */
+    static int find(std::string_view badge);
+
+    static int getNumBadges();
+
+private:
+    /*
+     * Names and the hash index are only written under the lock and read without
+     * it. A name is stored before its id is published in the index or the count,
+     * and neither a chunk nor an index slot is ever moved or reused.
+     */
+    static std::atomic<const string**> _chunks[MAX_BADGES / BADGE_CHUNK];
+    static std::atomic<uint16_t> _index[2 * MAX_BADGES];  /* Open addressing by name hash, 0 is empty */
+    static std::atomic<int> _numBadges;
+    static std::mutex _lock;
+
+    static int probe(std::string_view badge, size_t& slot);
+};
@@ -0,0 +1,97 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * TreeStats.cpp
+ * Implementation for the per-thread counter registry.
+ */
+
+#include "treestats.h"
+#include <mutex>
+#include <algorithm>
+
+void CounterTotals::add(const TreeCounters& counters) {
+  lookups += counters.lookups.get();
+  comparisons += counters.comparisons.get();
+  imbalanceChecks += counters.imbalanceChecks.get();
+  rebalances += counters.rebalances.get();
+  rebalancedNodes += counters.rebalancedNodes.get();
+  for(int i = 0; i < STATS_BUCKETS; i++) {
+    lookupDepths[i] += counters.lookupDepths[i].get();
+    rebalanceSizes[i] += counters.rebalanceSizes[i].get();
+  }
+}
+
+namespace {
+
+struct ThreadCounters;
+
+/* Every live thread's counters, and the sum left behind by threads that exited */
+struct Registry {
+  std::mutex lock;
+  std::vector<ThreadCounters*> threads;
+  CounterTotals retired[NUM_COUNTER_SETS];
+};
+
+Registry& registry() {
+  static Registry* instance = new Registry(); //never destroyed, threads may exit during shutdown
+  return *instance;
+}
+
+struct ThreadCounters {
+  TreeCounters counters[NUM_COUNTER_SETS];
+
+  ThreadCounters() {
+    std::lock_guard<std::mutex> guard(registry().lock);
+    registry().threads.push_back(this);
+  }
+
+  ~ThreadCounters() {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    for(int kind = 0; kind < NUM_COUNTER_SETS; kind++)
+      reg.retired[kind].add(counters[kind]);
+    reg.threads.erase(std::find(reg.threads.begin(), reg.threads.end(), this));
+  }
+};
+
+}
+
+TreeCounters& StatsRegistry::local(int kind) {
+  static thread_local ThreadCounters mine;
+  return mine.counters[kind];
+}
+
+CounterTotals StatsRegistry::total(int kind) {
+  Registry& reg = registry();
+  std::lock_guard<std::mutex> guard(reg.lock);
+  CounterTotals totals = reg.retired[kind];
+  for(ThreadCounters* thread : reg.threads)
+    totals.add(thread->counters[kind]);
+  return totals;
+}
+
+void StatsRegistry::reset() {
+  Registry& reg = registry();
+  std::lock_guard<std::mutex> guard(reg.lock);
+  for(int kind = 0; kind < NUM_COUNTER_SETS; kind++) {
+    reg.retired[kind] = CounterTotals();
+    for(ThreadCounters* thread : reg.threads) {
+      TreeCounters& counters = thread->counters[kind];
+      for(StatCounter* counter : {&counters.lookups, &counters.comparisons, &counters.imbalanceChecks,
+                                  &counters.rebalances, &counters.rebalancedNodes})
+        counter->reset();
+      for(int i = 0; i < STATS_BUCKETS; i++) {
+        counters.lookupDepths[i].reset();
+        counters.rebalanceSizes[i].reset();
+      }
+    }
+  }
+}
+
+bool StatsRegistry::isEnabled() {
+#ifdef TREE_STATS
+  return true;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,125 @@
+/**
+ * CMSC 341 - Spring 2021
+ * Project 2 - Binary Trees
+ * TreeStats.h
+ * Hot-path counters for the trees, kept per thread and compiled out unless
+ * TREE_STATS is defined, plus the structures returned by the stats() calls.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#define STATS_BUCKETS 32     /* Histogram buckets, deep enough for any balanced tree */
+#define UTREE_COUNTERS 0
+#define DTREE_COUNTERS 1
+#define NUM_COUNTER_SETS 2
+
+#ifdef TREE_STATS
+#define STATS(statement) statement
+#else
+#define STATS(statement)
+#endif
+
+/**
+ * A counter only its own thread writes. Plain relaxed load and store keep the
+ * increment as cheap as a non-atomic one while readers on other threads still
+ * see whole values.
+ */
+class StatCounter {
+public:
+    StatCounter(): _value(0) {}
+    StatCounter& operator+=(uint64_t amount) {
+        _value.store(_value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        return *this;
+    }
+    uint64_t get() const {return _value.load(std::memory_order_relaxed);}
+    void reset() {_value.store(0, std::memory_order_relaxed);}
+
+private:
+    std::atomic<uint64_t> _value;
+};
+
+/* Hot-path counters for one kind of tree */
+struct TreeCounters {
+    StatCounter lookups;
+    StatCounter comparisons;                    /* Nodes compared against, over all lookups */
+    StatCounter lookupDepths[STATS_BUCKETS];    /* Lookups by number of comparisons */
+    StatCounter imbalanceChecks;
+    StatCounter rebalances;
+    StatCounter rebalancedNodes;                /* Nodes in the subtrees rebalance() was handed */
+    StatCounter rebalanceSizes[STATS_BUCKETS];  /* Rebalances by floor(log2(subtree size)) */
+
+    void recordLookup(int depth) {
+        lookups += 1;
+        comparisons += depth;
+        lookupDepths[depth < STATS_BUCKETS ? depth : STATS_BUCKETS - 1] += 1;
+    }
+    void recordRebalance(int size) {
+        int bucket = 0;
+        while(bucket + 1 < STATS_BUCKETS && (size >> (bucket + 1)) > 0) bucket++;
+        rebalances += 1;
+        rebalancedNodes += size;
+        rebalanceSizes[bucket] += 1;
+    }
+};
+
+/* A snapshot of TreeCounters summed over every thread */
+struct CounterTotals {
+    uint64_t lookups = 0;
+    uint64_t comparisons = 0;
+    uint64_t lookupDepths[STATS_BUCKETS] = {};
+    uint64_t imbalanceChecks = 0;
+    uint64_t rebalances = 0;
+    uint64_t rebalancedNodes = 0;
+    uint64_t rebalanceSizes[STATS_BUCKETS] = {};
+
+    double comparisonsPerLookup() const {return lookups == 0 ? 0 : static_cast<double>(comparisons) / lookups;}
+    void add(const TreeCounters& counters);
+};
+
+/**
+ * Hands every thread its own counters and sums them on request. Counters of
+ * threads that have exited are folded into a retired total, so nothing is lost.
+ */
+class StatsRegistry {
+public:
+    /* Counters of the calling thread, kind is UTREE_COUNTERS or DTREE_COUNTERS */
+    static TreeCounters& local(int kind);
+
+    static CounterTotals total(int kind);
+    static void reset();
+    static bool isEnabled();
+};
+
+/* Shape of one DTree, from a walk over its nodes */
+struct DTreeStats {
+    int numNodes = 0;
+    int numLive = 0;
+    int numVacant = 0;
+    double vacantRatio = 0;
+    int height = 0;
+    std::vector<int> depthHistogram;    /* Live accounts by depth, the root is depth 1 */
+    int numCompactions = 0;
+    size_t bytesAllocated = 0;          /* A pool shared with copies is counted in full */
+    CounterTotals counters;             /* Process-wide DTree counters, zero unless TREE_STATS */
+};
+
+/* Shape of a UTree and all of its DTrees, from a walk over their nodes */
+struct UTreeStats {
+    int numUsers = 0;                   /* UNodes, one per username */
+    int numAccounts = 0;
+    int numDNodes = 0;
+    int numVacant = 0;
+    double vacantRatio = 0;
+    double worstVacantRatio = 0;        /* Of the most tombstone-heavy DTree */
+    int height = 0;
+    std::vector<int> depthHistogram;    /* UNodes by depth, the root is depth 1 */
+    int maxDTreeHeight = 0;
+    size_t bytesAllocated = 0;          /* Both UTree pools and every DTree pool, shared ones in full */
+    CounterTotals utreeCounters;        /* Process-wide counters, zero unless TREE_STATS */
+    CounterTotals dtreeCounters;
+};
@@ -7,6 +7,8 @@
 
 #include "utree.h"
 
+int (*UTree::_syncFd)(int fd) = fsync;
+
 /**
  * Destructor, deletes all dynamic memory.
  */
@@ -14,47 +16,462 @@ UTree::~UTree() {
   clear();
 }
 
+/**
+ * Copy constructor, shares every node of another UTree in O(1).
+ * @param rhs Source UTree to copy
+ */
+UTree::UTree(const UTree& rhs): _root(nullptr) {
+  *this = rhs;
+}
+
+/**
+ * Overloaded assignment operator, makes a copy of a UTree in O(1). Both trees share
+ * their UNodes and DNodes until one of them changes, which copies the UNodes on its
+ * path and, in the DTree it changes, the DNodes on that path. Secondary indexes kept
+ * by this tree are rebuilt from the new contents, which costs O(n).
+ * @param rhs Source UTree to copy
+ * @return Copy of rhs
+ */
+UTree& UTree::operator=(const UTree& rhs) {
+  if(this != &rhs) {
+    clear();
+
+    //shared nodes go back to the pools they came from, whichever tree drops them last
+    if(rhs._root != nullptr) {
+      _unodePool.share(rhs._unodePool);
+      _dtreePool.share(rhs._dtreePool);
+      rhs._root->_refs.add();
+    }
+    _root = rhs._root;
+    rebuildIndex();
+  }
+  return *this;
+}
+
 /**
  * Sources a .csv file to populate Account objects and insert them into the UTree.
+ * Malformed lines are reported on stderr with their line number and skipped.
  * @param infile path to .csv file containing database of accounts
  * @param append true to append to an existing tree structure or false to clear before importing
+ * @param bulk true to collect every account and build the trees in one pass with bulkLoad()
  */ 
-void UTree::loadData(string infile, bool append) {
-    std::ifstream instream(infile);
-    string line;
-    char delim = ',';
-    const int numFields = 5;
-    string fields[numFields];
+void UTree::loadData(string infile, bool append, bool bulk) {
+    size_t length = 0;
+    const char* begin = mapFile(infile, length);
 
-    /* Check to make sure the file was opened */
-    if(!instream.is_open()) {
-        std::cerr << __FUNCTION__ << ": File " << infile << " could not be opened or located" << endl;
-        exit(-1);
+    /* Should we append or clear? */
+    if(!append) this->clear();
+    if(begin == nullptr) return;
+
+    if(bulk) {
+        std::vector<Account> accounts;
+        parseLines(begin, begin + length, infile, 1, [&accounts](const Account& newAcct) {
+            accounts.push_back(newAcct);
+        });
+        bulkLoad(accounts);
+    } else {
+        parseLines(begin, begin + length, infile, 1, [this](const Account& newAcct) {
+            this->insert(newAcct);
+        });
     }
 
-    /* Should we append or clear? */
+    munmap(const_cast<char*>(begin), length);
+}
+
+/**
+ * Sources a .csv file like loadData(), spreading the work over several threads.
+ * Threads parse one chunk of the file each and partition the rows by username,
+ * every shard of usernames is then bulk loaded by a single thread and the
+ * resulting UNodes are merged into one balanced UTree. The tree holds the same
+ * accounts a single threaded load would.
+ * @param infile path to .csv file containing database of accounts
+ * @param numThreads number of threads to parse and build with
+ * @param append true to append to an existing tree structure or false to clear before importing
+ */
+void UTree::loadDataParallel(string infile, int numThreads, bool append) {
+    if(numThreads < 1) numThreads = 1;
+
+    size_t length = 0;
+    const char* begin = mapFile(infile, length);
+
     if(!append) this->clear();
+    if(begin == nullptr) return;
+    const char* end = begin + length;
 
-    /* Read in the data from the .csv file and insert into the UTree */
-    while(std::getline(instream, line)) {
-        std::stringstream buffer(line);
+    auto runOnAll = [numThreads](auto job) {
+        std::vector<std::thread> workers;
+        for(int t = 0; t < numThreads; t++)
+            workers.emplace_back(job, t);
+        for(std::thread& worker : workers)
+            worker.join();
+    };
 
-        /* Quick check to make sure each line is formatted correctly */
-        int delimCount = 0;
-        for(unsigned int c = 0; c < buffer.str().length(); c++) if(buffer.str()[c] == delim) delimCount++;
-        if(delimCount != numFields - 1) {
-            throw std::invalid_argument("Malformed input file detected - ensure each line contains 5 fields deliminated by a ','");
-        }
+    /* Split the file into one chunk per thread at line boundaries */
+    std::vector<const char*> bounds(numThreads + 1, end);
+    bounds[0] = begin;
+    for(int t = 1; t < numThreads; t++) {
+        const char* guess = std::max(begin + length / numThreads * t, bounds[t-1]);
+        const char* newline = static_cast<const char*>(memchr(guess, '\n', end - guess));
+        bounds[t] = (newline != nullptr ? newline + 1 : end);
+    }
 
-        /* Populate the account attributes - 
-         * Each line always has 5 sections of data */
-        for(int i = 0; i < numFields; i++) {
-            std::getline(buffer, line, delim);
-            fields[i] = line;
+    /* Count the lines of every chunk so errors report their line in the whole file */
+    std::vector<int> firstLine(numThreads + 1, 1);
+    runOnAll([&](int t) {
+        firstLine[t+1] = static_cast<int>(std::count(bounds[t], bounds[t+1], '\n'));
+    });
+    for(int t = 1; t <= numThreads; t++)
+        firstLine[t] += firstLine[t-1];
+
+    /* Usernames are interned, so the pooled address identifies the shard */
+    int numShards = numThreads;
+    auto shardOf = [numShards](const Account& acct) {
+        uint64_t key = reinterpret_cast<uintptr_t>(acct._username) * 0x9E3779B97F4A7C15ull;
+        return static_cast<int>((key >> 32) % numShards);
+    };
+
+    /* Accounts already in the tree go first so they win over duplicates */
+    std::vector<std::vector<Account>> existing(numShards);
+    if(_root != nullptr) {
+        std::vector<Account> accounts;
+        collectAccounts(_root, accounts);
+        for(const Account& acct : accounts)
+            existing[shardOf(acct)].push_back(acct);
+        clear();
+    }
+
+    /* Parse every chunk, partitioning the rows by shard */
+    std::vector<std::vector<std::vector<Account>>> buckets(numThreads, std::vector<std::vector<Account>>(numShards));
+    runOnAll([&](int t) {
+        parseLines(bounds[t], bounds[t+1], infile, firstLine[t], [&](const Account& newAcct) {
+            buckets[t][shardOf(newAcct)].push_back(newAcct);
+        });
+    });
+    munmap(const_cast<char*>(begin), length);
+
+    /* Each shard owns its usernames outright, so its trees are built without locking */
+    std::vector<UTree> shardTrees(numShards);
+    runOnAll([&](int s) {
+        std::vector<Account> accounts;
+        accounts.swap(existing[s]);
+        for(int t = 0; t < numThreads; t++) {
+            accounts.insert(accounts.end(), buckets[t][s].begin(), buckets[t][s].end());
+            std::vector<Account>().swap(buckets[t][s]);
         }
-        Account newAcct = Account(fields[0], std::stoi(fields[1]), std::stoi(fields[2]), fields[3], fields[4]);
-        this->insert(newAcct);
+        shardTrees[s].bulkLoad(accounts);
+    });
+
+    /* Take over the shards' nodes and link them into a single tree */
+    std::vector<UNode*> userNodes;
+    for(UTree& shard : shardTrees) {
+        collectNodes(shard._root, userNodes);
+        _unodePool.adopt(shard._unodePool);
+        _dtreePool.adopt(shard._dtreePool);
+        shard._root = nullptr;
+    }
+    std::sort(userNodes.begin(), userNodes.end(), [](UNode* lhs, UNode* rhs) {
+        return lhs->getUsername() < rhs->getUsername();
+    });
+    _root = buildBalanced(userNodes, 0, static_cast<int>(userNodes.size()) - 1);
+    rebuildIndex();
+}
+
+/**
+ * Replaces the contents of the UTree with the union of its accounts and the given ones,
+ * building every DTree and the UTree bottom-up so no rebalancing is needed.
+ * Accounts already in the tree win over duplicates, as they would with insert().
+ * @param accounts accounts to add, reordered by (username, discriminator) on return
+ */
+void UTree::bulkLoad(std::vector<Account>& accounts) {
+  //existing accounts go first so the stable sort keeps them ahead of their duplicates
+  if(_root != nullptr) {
+    std::vector<Account> existing;
+    collectAccounts(_root, existing);
+    accounts.insert(accounts.begin(), existing.begin(), existing.end());
+    clear();
+  }
+
+  std::stable_sort(accounts.begin(), accounts.end(), [](const Account& lhs, const Account& rhs) {
+    if(lhs._username != rhs._username) {
+      int order = lhs.getUsername().compare(rhs.getUsername());
+      if(order != 0) return order < 0;
     }
+    return lhs._disc < rhs._disc;
+  });
+
+  //keep the first of every (username, disc) pair
+  size_t numUnique = 0;
+  for(size_t i = 0; i < accounts.size(); i++) {
+    if(numUnique > 0 && accounts[i]._disc == accounts[numUnique - 1]._disc &&
+       accounts[i].getUsername() == accounts[numUnique - 1].getUsername())
+      continue;
+    accounts[numUnique++] = accounts[i];
+  }
+  accounts.resize(numUnique);
+
+  //one UNode per run of equal usernames, each with its DTree built from the run
+  std::vector<UNode*> userNodes;
+  size_t start = 0;
+  while(start < accounts.size()) {
+    size_t end = start + 1;
+    while(end < accounts.size() && accounts[end].getUsername() == accounts[start].getUsername())
+      end++;
+
+    UNode* node = _unodePool.create(_dtreePool.create(), accounts[start]._username);
+    node->_dtree->bulkLoad(&accounts[start], static_cast<int>(end - start));
+    userNodes.push_back(node);
+    start = end;
+  }
+
+  _root = buildBalanced(userNodes, 0, static_cast<int>(userNodes.size()) - 1);
+  rebuildIndex();
+}
+
+/**
+ * Writes every live account to a binary snapshot, sorted by (username, discriminator).
+ * The file is written next to its destination and renamed into place when complete.
+ * Layout, all integers in host byte order:
+ *   header   magic "UTSNAP\0\0", u32 version, u32 badges, u64 statuses, u64 usernames, u64 accounts,
+ *            u64 generation
+ *   badges   per badge id:  u32 length, bytes
+ *   statuses per status:    u32 length, bytes
+ *   users    per username:  u32 length, bytes, u32 number of accounts
+ *   accounts per account:   u32 status index, u16 disc with SNAPSHOT_NITRO_BIT for nitro, u16 badge id
+ *   footer   u64 FNV-1a checksum of everything before it
+ * @param path file to write the snapshot to
+ * @param generation number kept with the snapshot for its owner, see DurableUTree
+ * @param durable true to sync the snapshot before it replaces the file at path, and its name after
+ */
+void UTree::saveSnapshot(string path, uint64_t generation, bool durable) const {
+  string tempPath = path + ".tmp";
+  std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+  if(!out.is_open())
+    throw std::invalid_argument("File " + tempPath + " could not be opened for writing");
+
+  std::vector<UNode*> userNodes;
+  collectNodes(_root, userNodes);
+
+  //give every distinct status a dense index, in order of first use
+  std::vector<Account> accounts;
+  std::vector<uint32_t> runLengths;
+  std::vector<const string*> statuses;
+  std::unordered_map<const string*, uint32_t> statusIndex;
+  for(UNode* node : userNodes) {
+    size_t before = accounts.size();
+    node->_dtree->collectAccounts(accounts);
+    runLengths.push_back(static_cast<uint32_t>(accounts.size() - before));
+  }
+  std::vector<uint32_t> statusOf(accounts.size());
+  for(size_t i = 0; i < accounts.size(); i++) {
+    auto found = statusIndex.emplace(accounts[i]._status, static_cast<uint32_t>(statuses.size()));
+    if(found.second)
+      statuses.push_back(accounts[i]._status);
+    statusOf[i] = found.first->second;
+  }
+
+  uint64_t checksum = SNAPSHOT_FNV_OFFSET;
+  auto put = [&out, &checksum](const void* data, size_t length) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < length; i++)
+      checksum = (checksum ^ bytes[i]) * SNAPSHOT_FNV_PRIME;
+    out.write(static_cast<const char*>(data), length);
+  };
+  auto putString = [&put](const string& str) {
+    uint32_t length = static_cast<uint32_t>(str.size());
+    put(&length, sizeof(length));
+    put(str.data(), length);
+  };
+
+  uint32_t version = SNAPSHOT_VERSION;
+  uint32_t numBadges = static_cast<uint32_t>(BadgeDictionary::getNumBadges());
+  uint64_t counts[3] = {statuses.size(), userNodes.size(), accounts.size()};
+  put(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  put(&version, sizeof(version));
+  put(&numBadges, sizeof(numBadges));
+  put(counts, sizeof(counts));
+  put(&generation, sizeof(generation));
+
+  for(uint32_t id = 0; id < numBadges; id++)
+    putString(BadgeDictionary::nameOf(static_cast<uint16_t>(id)));
+  for(const string* status : statuses)
+    putString(*status);
+  for(size_t i = 0; i < userNodes.size(); i++) {
+    putString(userNodes[i]->getUsername());
+    put(&runLengths[i], sizeof(runLengths[i]));
+  }
+
+  //fixed size records, written in batches to keep the stream calls off the per-account path
+  unsigned char record[SNAPSHOT_RECORD_SIZE * 256];
+  size_t filled = 0;
+  for(size_t i = 0; i < accounts.size(); i++) {
+    unsigned char* slot = record + filled;
+    uint16_t disc = accounts[i]._disc | (accounts[i]._nitro ? SNAPSHOT_NITRO_BIT : 0);
+    memcpy(slot, &statusOf[i], sizeof(uint32_t));
+    memcpy(slot + 4, &disc, sizeof(uint16_t));
+    memcpy(slot + 6, &accounts[i]._badge, sizeof(uint16_t));
+    filled += SNAPSHOT_RECORD_SIZE;
+    if(filled == sizeof(record) || i + 1 == accounts.size()) {
+      put(record, filled);
+      filled = 0;
+    }
+  }
+
+  out.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+  out.close();
+
+  //the data must reach the disk before the rename does, or a crash could leave path naming a torn file
+  if(!out || (durable && !syncFile(tempPath)) || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+    std::remove(tempPath.c_str());
+    throw std::invalid_argument("Snapshot " + path + " could not be written");
+  }
+  size_t slash = path.rfind('/');
+  string directory = (slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash)));
+  if(durable && !syncFile(directory))
+    throw std::invalid_argument("Snapshot " + path + " could not be synced");
+}
+
+/**
+ * Replaces the contents of the UTree with the accounts of a snapshot written by saveSnapshot().
+ * The snapshot is checked against its checksum before anything is changed, then the
+ * pre-sorted accounts are built into balanced trees in a single sequential pass.
+ * @param path snapshot file to read
+ * @return generation the snapshot was saved with
+ */
+uint64_t UTree::loadSnapshot(string path) {
+  size_t length = 0;
+  const char* begin = mapFile(path, length);
+  const char* end = begin + length;
+
+  const size_t headerSize = sizeof(SNAPSHOT_MAGIC) + 2 * sizeof(uint32_t) + 4 * sizeof(uint64_t);
+  auto fail = [&](const string& reason) {
+    if(begin != nullptr) munmap(const_cast<char*>(begin), length);
+    throw std::invalid_argument("Snapshot " + path + " " + reason);
+  };
+  if(begin == nullptr || length < headerSize + sizeof(uint64_t) ||
+     memcmp(begin, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+    fail("is not a UTree snapshot");
+
+  uint64_t checksum = SNAPSHOT_FNV_OFFSET;
+  uint64_t expected;
+  end -= sizeof(expected);
+  memcpy(&expected, end, sizeof(expected));
+  for(const char* byte = begin; byte < end; byte++)
+    checksum = (checksum ^ static_cast<unsigned char>(*byte)) * SNAPSHOT_FNV_PRIME;
+  if(checksum != expected)
+    fail("failed its checksum");
+
+  //bounds checked readers over the verified payload
+  const char* cursor = begin + sizeof(SNAPSHOT_MAGIC);
+  bool truncated = false;
+  auto get = [&](void* data, size_t size) {
+    if(static_cast<size_t>(end - cursor) < size) {
+      truncated = true;
+      memset(data, 0, size);
+      return;
+    }
+    memcpy(data, cursor, size);
+    cursor += size;
+  };
+  auto getString = [&](string& str) {
+    uint32_t size = 0;
+    get(&size, sizeof(size));
+    if(static_cast<size_t>(end - cursor) < size) {
+      truncated = true;
+      size = 0;
+    }
+    str.assign(cursor, size);
+    cursor += size;
+  };
+
+  uint32_t version = 0;
+  uint32_t numBadges = 0;
+  uint64_t counts[3] = {0, 0, 0};
+  uint64_t generation = 0;
+  get(&version, sizeof(version));
+  get(&numBadges, sizeof(numBadges));
+  get(counts, sizeof(counts));
+  get(&generation, sizeof(generation));
+  if(version != SNAPSHOT_VERSION)
+    fail("has unsupported version " + std::to_string(version));
+  if(numBadges > MAX_BADGES || counts[0] > length || counts[1] > length || counts[2] > length)
+    fail("has a corrupt header");
+
+  auto decode = [](const char* record, uint32_t& status, uint16_t& disc, uint16_t& badge, bool& nitro) {
+    memcpy(&status, record, sizeof(status));
+    memcpy(&disc, record + 4, sizeof(disc));
+    memcpy(&badge, record + 6, sizeof(badge));
+    nitro = (disc & SNAPSHOT_NITRO_BIT) != 0;
+    disc &= ~SNAPSHOT_NITRO_BIT;
+  };
+
+  //map the file's badge ids and status indices onto this process's pools
+  string str;
+  std::vector<uint16_t> badgeIds(numBadges, NO_BADGE);
+  for(uint32_t id = 0; id < numBadges; id++) {
+    getString(str);
+    badgeIds[id] = BadgeDictionary::idOf(str);
+  }
+  std::vector<const string*> statuses(counts[0]);
+  for(uint64_t i = 0; i < counts[0]; i++) {
+    getString(str);
+    statuses[i] = (str.empty() ? StringPool::empty() : StringPool::statuses().intern(str));
+  }
+  std::vector<const string*> usernames(counts[1]);
+  std::vector<uint32_t> runLengths(counts[1]);
+  uint64_t total = 0;
+  for(uint64_t i = 0; i < counts[1]; i++) {
+    getString(str);
+    usernames[i] = (str.empty() ? StringPool::empty() : StringPool::usernames().intern(str));
+    get(&runLengths[i], sizeof(uint32_t));
+    total += runLengths[i];
+  }
+  if(truncated || total != counts[2] || static_cast<size_t>(end - cursor) != counts[2] * SNAPSHOT_RECORD_SIZE)
+    fail("is truncated or corrupt");
+
+  //check every record and the sort order before the current contents are dropped
+  const char* record = cursor;
+  for(uint64_t i = 0; i < counts[1]; i++) {
+    if(runLengths[i] == 0 || (i > 0 && !(*usernames[i-1] < *usernames[i])))
+      fail("is not sorted by username");
+    int lastDisc = INVALID_DISC;
+    for(uint32_t a = 0; a < runLengths[i]; a++, record += SNAPSHOT_RECORD_SIZE) {
+      uint32_t status;
+      uint16_t disc, badge;
+      bool nitro;
+      decode(record, status, disc, badge, nitro);
+      if(status >= statuses.size() || badge >= numBadges || disc > MAX_DISC || disc <= lastDisc)
+        fail("holds an invalid account");
+      lastDisc = disc;
+    }
+  }
+
+  //each run of records is one username's DTree, already in discriminator order
+  clear();
+  std::vector<UNode*> userNodes;
+  std::vector<Account> run;
+  for(uint64_t i = 0; i < counts[1]; i++) {
+    run.resize(runLengths[i]);
+    for(uint32_t a = 0; a < runLengths[i]; a++, cursor += SNAPSHOT_RECORD_SIZE) {
+      uint32_t status;
+      uint16_t disc, badge;
+      bool nitro;
+      decode(cursor, status, disc, badge, nitro);
+      run[a]._username = usernames[i];
+      run[a]._status = statuses[status];
+      run[a]._disc = disc;
+      run[a]._badge = badgeIds[badge];
+      run[a]._nitro = nitro;
+    }
+
+    UNode* node = _unodePool.create(_dtreePool.create(), usernames[i]);
+    node->_dtree->bulkLoad(run.data(), static_cast<int>(run.size()));
+    userNodes.push_back(node);
+  }
+  munmap(const_cast<char*>(begin), length);
+
+  _root = buildBalanced(userNodes, 0, static_cast<int>(userNodes.size()) - 1);
+  rebuildIndex();
+  return generation;
 }
 
 /**
@@ -64,30 +481,77 @@ void UTree::loadData(string infile, bool append) {
  * @param newAcct Account object to be inserted into the corresponding DTree
  * @return true if the account was inserted, false otherwise
  */
-bool UTree::insert(Account newAcct) {
-  UNode* temp = retrieve(newAcct.getUsername());
-  
-  if(temp != nullptr){
-    if(temp->_dtree->insert(newAcct))
-      return true;
-    else
-      return false;
+bool UTree::insert(const Account& newAcct) {
+  return tryInsert(newAcct).second;
+}
+
+/**
+ * Finds the DNode for an account's username and discriminator, inserting the account
+ * if it is not already live. The UTree and the DTree are each descended once.
+ * @param newAcct Account object to insert
+ * @return the DNode holding the account and true if newAcct was inserted,
+ *         or the existing live DNode and false
+ */
+std::pair<DNode*, bool> UTree::tryInsert(const Account& newAcct) {
+  //the path may be shared with a copy, only worth copying if the account is new
+  if(_unodePool.isShared()) {
+    DNode* existing = retrieveUser(newAcct.getUsername(), newAcct.getDiscriminator());
+    if(existing != nullptr)
+      return std::make_pair(existing, false);
   }
-  
-    _root = insert(newAcct, _root);
 
-    return true;
+  bool inserted = false;
+  DNode* slot = tryInsert(newAcct, _root, inserted);
+  if(inserted && _index != nullptr)
+    _index->add(slot->getAccount());
+  return std::make_pair(slot, inserted);
+}
+
+/**
+ * Builds an account from its fields and inserts it like tryInsert(). The strings are
+ * interned straight from the views, so an existing username or status costs no allocation.
+ * @param username account username
+ * @param disc account discriminator
+ * @param nitro whether the account has nitro
+ * @param badge badge name, empty for none
+ * @param status account status
+ * @return the DNode holding the account and true if it was inserted,
+ *         or the existing live DNode and false
+ */
+std::pair<DNode*, bool> UTree::emplace(std::string_view username, int disc, bool nitro,
+                                       std::string_view badge, std::string_view status) {
+  return tryInsert(Account(username, disc, nitro, badge, status));
 }
 
 /**
  * Removes a user with a matching username and discriminator.
  * @param username username to match
  * @param disc discriminator to match
- * @param removed DNode object to hold removed account
+ * @param removed Account object to hold the removed account
  * @return true if an account was removed, false otherwise
  */
-bool UTree::removeUser(string username, int disc, DNode*& removed) {
+bool UTree::removeUser(std::string_view username, int disc, Account& removed) {
+  UNode* temp = retrieve(username);
+  if(temp == nullptr)
+    return false;
+
+  //a UNode under a shared one is reachable from a copy too, so the whole path is copied first
+  if(_unodePool.isShared()) {
+    if(temp->_dtree->retrieve(disc) == nullptr)
+      return false;
+    temp = ownPath(username);
+  }
+
+  if(!temp->_dtree->remove(disc, removed))
+    return false;
+  if(_index != nullptr)
+    _index->remove(removed);
 
+  //drop the UNode once its DTree has no users left, removed is a copy and outlives it
+  if(temp->_dtree->getNumUsers() == 0)
+    _root = remover(username, _root);
+
+  return true;
 }
 
 /**
@@ -95,7 +559,7 @@ bool UTree::removeUser(string username, int disc, DNode*& removed) {
  * @param username username to match
  * @return UNode with a matching username, nullptr otherwise
  */
-UNode* UTree::retrieve(string username) {
+UNode* UTree::retrieve(std::string_view username) const {
   return retrieve(username, _root);
 }
 
@@ -105,7 +569,7 @@ UNode* UTree::retrieve(string username) {
  * @param disc discriminator to match
  * @return DNode with a matching username and discriminator, nullptr otherwise
  */
-DNode* UTree::retrieveUser(string username, int disc) {
+DNode* UTree::retrieveUser(std::string_view username, int disc) const {
  UNode* temp =  retrieve(username);
  if(temp == nullptr)
    return nullptr;
@@ -114,12 +578,178 @@ DNode* UTree::retrieveUser(string username, int disc) {
  return tempDisc;
 }
 
+/**
+ * Retrieves the accounts for many keys at once. Up to BATCH_LANES descents are
+ * interleaved: each step of a descent prefetches the next node it needs and then
+ * yields to the other lanes, so the cache misses of different keys overlap
+ * instead of being paid one after another.
+ * @param keys usernames and discriminators to match
+ * @param count number of keys
+ * @param results filled with the DNode matching each key, nullptr where there is none
+ */
+void UTree::retrieveUserBatch(const UserKey keys[], int count, DNode* results[]) const {
+  enum Stage {USERNAME, USERNAME_DATA, USER_COMPARE, DTREE_ROOT, DISC_COMPARE};
+  struct Lane {
+    int key;
+    Stage stage;
+    UNode* user;
+    DNode* node;
+  };
+
+  Lane lanes[BATCH_LANES];
+  int nextKey = 0;
+  int active = 0;
+
+  //starts the next key on a lane, returns false when every key is taken
+  auto start = [&](Lane& lane) {
+    if(nextKey == count)
+      return false;
+    lane.key = nextKey++;
+    lane.stage = USERNAME;
+    lane.user = _root;
+    __builtin_prefetch(_root);
+    return true;
+  };
+  for(int i = 0; i < BATCH_LANES && start(lanes[active]); i++)
+    active++;
+
+  while(active > 0){
+    for(int i = 0; i < active; i++){
+      Lane& lane = lanes[i];
+      const UserKey& key = keys[lane.key];
+      bool done = false;
+
+      switch(lane.stage){
+      case USERNAME:
+        //the UNode is in cache, fetch the pooled string it points to
+        if(lane.user == nullptr){
+          results[lane.key] = nullptr;
+          done = true;
+          break;
+        }
+        __builtin_prefetch(lane.user->_username);
+        lane.stage = USERNAME_DATA;
+        break;
+
+      case USERNAME_DATA:
+        //the string is in cache, fetch the characters the compare reads
+        __builtin_prefetch(lane.user->_username->data());
+        lane.stage = USER_COMPARE;
+        break;
+
+      case USER_COMPARE: {
+        int order = key.username.compare(*lane.user->_username);
+        if(order == 0){
+          __builtin_prefetch(lane.user->_dtree);
+          lane.stage = DTREE_ROOT;
+        } else {
+          lane.user = (order < 0 ? lane.user->_left : lane.user->_right);
+          __builtin_prefetch(lane.user);
+          lane.stage = USERNAME;
+        }
+        break;
+      }
+
+      case DTREE_ROOT:
+        lane.node = lane.user->_dtree->_root;
+        __builtin_prefetch(lane.node);
+        lane.stage = DISC_COMPARE;
+        break;
+
+      case DISC_COMPARE:
+        //same search as DTree::retrieve, one level per step
+        if(lane.node == nullptr){
+          results[lane.key] = nullptr;
+          done = true;
+        } else if(lane.node->_account.getDiscriminator() == key.disc){
+          results[lane.key] = (lane.node->_vacant ? nullptr : lane.node);
+          done = true;
+        } else {
+          lane.node = (key.disc < lane.node->_account.getDiscriminator() ? lane.node->_left : lane.node->_right);
+          __builtin_prefetch(lane.node);
+        }
+        break;
+      }
+
+      //a finished lane picks up the next key, or is retired by moving the last lane into it
+      if(done && !start(lane)){
+        lane = lanes[--active];
+        i--;
+      }
+    }
+  }
+}
+
+#ifdef HAVE_COROUTINE_LOOKUPS
+/**
+ * Retrieves a set of users like retrieve(), suspending after the prefetch of every
+ * UNode, of every username it compares against and of that username's characters.
+ * @param username username to match
+ * @return lookup yielding the UNode with a matching username, nullptr otherwise
+ */
+Lookup<UNode*> UTree::retrieveAsync(std::string_view username) const {
+  UNode* node = _root;
+  co_await Prefetch{node};
+  while(node != nullptr){
+    co_await Prefetch{node->_username};
+    co_await Prefetch{node->_username->data()};
+    int order = username.compare(*node->_username);
+    if(order == 0)
+      co_return node;
+
+    node = (order < 0 ? node->_left : node->_right);
+    co_await Prefetch{node};
+  }
+  co_return nullptr;
+}
+
+/**
+ * Retrieves an account like retrieveUser(), running both descents as one lookup.
+ * @param username username to match
+ * @param disc discriminator to match
+ * @return lookup yielding the DNode with a matching username and discriminator, nullptr otherwise
+ */
+Lookup<DNode*> UTree::retrieveUserAsync(std::string_view username, int disc) const {
+  UNode* user = co_await retrieveAsync(username);
+  if(user == nullptr)
+    co_return nullptr;
+
+  co_await Prefetch{user->_dtree};
+  co_return co_await user->_dtree->retrieveAsync(disc);
+}
+#endif
+
+/**
+ * Picks a discriminator that no live account with the username uses, in O(log n).
+ * The discriminator is not reserved, the caller inserts the account.
+ * @param username username the discriminator is for
+ * @param policy LOWEST_FREE for the smallest free discriminator, RANDOM_FREE for a uniform pick
+ * @return a free discriminator in [MIN_DISC, MAX_DISC]
+ * @throws std::out_of_range if every discriminator of the username is taken
+ */
+int UTree::allocateDiscriminator(std::string_view username, DiscPolicy policy) const {
+  static thread_local std::mt19937 rng(std::random_device{}());
+
+  UNode* node = retrieve(username);
+  DTree empty;
+  const DTree& dtree = (node == nullptr ? empty : *node->_dtree);
+
+  int numFree = dtree.getNumFree();
+  if(numFree == 0)
+    throw std::out_of_range("No free discriminator left for " + string(username));
+
+  int k = 0;
+  if(policy == RANDOM_FREE)
+    k = std::uniform_int_distribution<>(0, numFree - 1)(rng);
+  return dtree.selectFree(k);
+}
+
 /**
  * Returns the number of users with a specific username.
  * @param username username to match
  * @return number of users with the specified username
  */
-int UTree::numUsers(string username) {
+int UTree::numUsers(std::string_view username) const {
   UNode* temp = retrieve (username);
   if(temp == nullptr)
     return 0;
@@ -127,11 +757,93 @@ int UTree::numUsers(string username) {
   return temp->getDTree()->getNumUsers();
 }
 
+/**
+ * Returns the number of users with a specific username that have nitro.
+ * @param username username to match
+ * @return number of nitro users with the specified username
+ */
+int UTree::numNitro(std::string_view username) const {
+  UNode* temp = retrieve(username);
+  if(temp == nullptr)
+    return 0;
+
+  return temp->_dtree->getNumNitro();
+}
+
+/**
+ * Returns the number of users with a specific username that have a badge.
+ * @param username username to match
+ * @param badge badge name, empty for users without a badge
+ * @return number of users with the specified username and badge
+ */
+int UTree::numWithBadge(std::string_view username, std::string_view badge) const {
+  UNode* temp = retrieve(username);
+  if(temp == nullptr)
+    return 0;
+
+  return temp->_dtree->getNumWithBadge(badge);
+}
+
+/**
+ * Reports the shape of the UTree and its DTrees, and the process-wide counters.
+ * Walks every UNode and DNode, so it costs O(n).
+ * @return node and vacancy counts, heights, UNode depth histogram and bytes allocated
+ */
+UTreeStats UTree::stats() const {
+  UTreeStats stats;
+  stats.bytesAllocated = _unodePool.getBytesAllocated() + _dtreePool.getBytesAllocated();
+  addDepths(_root, 1, stats);
+  for(UNode* node : *this){
+    DTreeStats dtree = node->_dtree->stats();
+    stats.numUsers++;
+    stats.numAccounts += dtree.numLive;
+    stats.numDNodes += dtree.numNodes;
+    stats.numVacant += dtree.numVacant;
+    stats.worstVacantRatio = std::max(stats.worstVacantRatio, dtree.vacantRatio);
+    stats.maxDTreeHeight = std::max(stats.maxDTreeHeight, dtree.height);
+    stats.bytesAllocated += dtree.bytesAllocated;
+  }
+  stats.vacantRatio = (stats.numDNodes == 0 ? 0 : static_cast<double>(stats.numVacant) / stats.numDNodes);
+  stats.utreeCounters = StatsRegistry::total(UTREE_COUNTERS);
+  stats.dtreeCounters = StatsRegistry::total(DTREE_COUNTERS);
+  return stats;
+}
+
 /**
  * Helper for the destructor to clear dynamic memory.
  */
 void UTree::clear() {
-  clear(_root);
+  if(_unodePool.isShared()) {
+    //UNodes a copy still links to stay, the rest go back to the shared pools
+    release(_root);
+    _unodePool.detach();
+    _dtreePool.detach();
+  } else {
+    clear(_root);
+    _unodePool.release();
+    _dtreePool.release();
+  }
+  _root = nullptr;
+  if(_index != nullptr)
+    _index->clear();
+}
+
+/**
+ * Starts keeping secondary indexes on nitro, badge and status presence, built
+ * from the accounts already in the tree. Does nothing if they are kept already.
+ */
+void UTree::enableIndex() {
+  if(_index != nullptr)
+    return;
+  _index.reset(new AccountIndex());
+  rebuildIndex();
+}
+
+/**
+ * Stops keeping the secondary indexes and frees them.
+ */
+void UTree::disableIndex() {
+  _index.reset();
 }
 
 /**
@@ -169,16 +881,16 @@ void UTree::updateHeight(UNode* node) {
 /**
  * Checks for an imbalance, defined by AVL rules, at the specified node.
  * @param node UNode object to inspect for an imbalance
- * @return (can change) returns true if an imbalance occured, false otherwise
+ * @return balance factor (left height - right height), outside [-1, 1] if an imbalance occured
  */
 int UTree::checkImbalance(UNode* node) {
   if(node == nullptr)
     return 0;
+  STATS(StatsRegistry::local(UTREE_COUNTERS).imbalanceChecks += 1);
 
-  if(node->_left->_height > node->_right->_height)
-    return (node->_left->_height - node->_right->_height);
-  else
-    return (node->_right->_height - node->_left->_height);
+  int lHeight = (node->_left == nullptr ? -1 : node->_left->_height);
+  int rHeight = (node->_right == nullptr ? -1 : node->_right->_height);
+  return lHeight - rHeight;
 }
 
 //----------------
@@ -187,10 +899,39 @@ int UTree::checkImbalance(UNode* node) {
  * @param node UNode object where an imbalance occurred
  */
 void UTree::rebalance(UNode*& node) {
+  if(node == nullptr)
+    return;
 
-// -- OR --
+  int balance = checkImbalance(node);
+  int rotated = 0; //nodes relinked, two per rotation less the one they share
+  if(balance > 1){
+    //rotations relink every node they touch, so none of them can stay shared with a copy
+    own(node);
+    //left-right case needs the left child rotated first
+    if(checkImbalance(node->_left) < 0){
+      node->_left = rotateLeft(own(node->_left));
+      rotated++;
+    }
+    node = rotateRight(node);
+    rotated += 2;
+  }
+  else{
+    if(balance < -1){
+      own(node);
+      //right-left case needs the right child rotated first
+      if(checkImbalance(node->_right) > 0){
+        node->_right = rotateRight(own(node->_right));
+        rotated++;
+      }
+      node = rotateLeft(node);
+      rotated += 2;
+    }
+  }
+  STATS(if(rotated > 0) StatsRegistry::local(UTREE_COUNTERS).recordRebalance(rotated));
 }
 
+// -- OR --
+
 /**
  * Begins and manages the rebalance procedure for an AVL tree (returns a pointer).
  * @param node UNode object where an imbalance occurred
@@ -201,20 +942,81 @@ void UTree::rebalance(UNode*& node) {
 //}
 //----------------
 
-UNode* UTree::retrieve(string username, UNode*& node){
-  if(node == nullptr)
-    return nullptr;
+UNode* UTree::retrieve(std::string_view username, UNode* node) const{
+  //one three-way comparison per level against the cached username
+  int depth = 0;
+  while(node != nullptr){
+    depth++;
+    int order = username.compare(node->getUsername());
+    if(order == 0)
+      break;
+    node = (order < 0 ? node->_left : node->_right);
+  }
+  STATS(StatsRegistry::local(UTREE_COUNTERS).recordLookup(depth));
+  return node;
+}
+
+UNode* UTree::own(UNode*& node){
+  if(node == nullptr || !isShared(node))
+    return node;
 
-  if(node->getUsername() == username)
+  //the copy gets its own DTree, an O(1) copy sharing every DNode
+  UNode* copy = _unodePool.create(_dtreePool.create(*node->_dtree), node->_username);
+  copy->_height = node->_height;
+  copy->_left = node->_left;
+  copy->_right = node->_right;
+  if(copy->_left != nullptr)
+    copy->_left->_refs.add();
+  if(copy->_right != nullptr)
+    copy->_right->_refs.add();
+  release(node);
+  node = copy;
+  return node;
+}
+
+UNode* UTree::ownPath(std::string_view username){
+  //copy every shared UNode from the root down to the username
+  UNode** link = &_root;
+  while(*link != nullptr){
+    UNode* node = own(*link);
+    int order = username.compare(node->getUsername());
+    if(order == 0)
       return node;
-  else{
-    if(node->getUsername() > username)
-      return retrieve(username, node->_left);
-    else{
-      if(node->getUsername() < username)
-        return retrieve(username, node->_right);
-    }
+    link = (order < 0 ? &node->_left : &node->_right);
   }
+  return nullptr;
+}
+
+void UTree::release(UNode* node){
+  //a UNode and its DTree go back to the pools once no tree or parent links to it
+  if(node == nullptr || !node->_refs.drop())
+    return;
+  release(node->_left);
+  release(node->_right);
+  _dtreePool.destroy(node->_dtree);
+  _unodePool.destroy(node);
+}
+
+void UTree::rebuildIndex(){
+  if(_index == nullptr)
+    return;
+
+  _index->clear();
+  for(UNode* node : *this)
+    for(DNode* account : node->_dtree->range(MIN_DISC, MAX_DISC))
+      _index->add(account->getAccount());
+}
+
+void UTree::addDepths(UNode* node, int depth, UTreeStats& stats) const{
+  if(node == nullptr)
+    return;
+
+  stats.height = std::max(stats.height, depth);
+  if(static_cast<int>(stats.depthHistogram.size()) < depth)
+    stats.depthHistogram.resize(depth, 0);
+  stats.depthHistogram[depth - 1]++;
+  addDepths(node->_left, depth + 1, stats);
+  addDepths(node->_right, depth + 1, stats);
 }
 
 void UTree::clear(UNode* node){
@@ -223,7 +1025,7 @@ void UTree::clear(UNode* node){
   else{
     clear(node->_left);
     clear(node->_right);
-    delete node;
+    node->_dtree->~DTree(); //each DTree hands its own slabs back, the slots go with the pools
   }
 }
 
@@ -236,32 +1038,263 @@ void UTree::printUsers(UNode* node) const {
   printUsers(node->_right);
 }
 
-UNode* UTree::insert(Account newAcct, UNode*& node){
+DNode* UTree::tryInsert(const Account& newAcct, UNode*& node, bool& inserted){
   if(node == nullptr){
-    UNode* node = new UNode();
-    if(node->getDTree()->insert(newAcct))
-      return node;
-    else
-      return nullptr;
+    node = _unodePool.create(_dtreePool.create(), newAcct._username);
+    inserted = true;
+    return node->_dtree->tryInsert(newAcct).first;
   }
+
+  own(node); //its DTree or height changes below, so it cannot stay shared with a copy
+
+  //pooled usernames are equal exactly when their pointers are
+  int order = (newAcct._username == node->_username ? 0 : newAcct.getUsername().compare(node->getUsername()));
+  if(order == 0){
+    //the username exists, the UTree shape does not change
+    std::pair<DNode*, bool> result = node->_dtree->tryInsert(newAcct);
+    inserted = result.second;
+    return result.first;
+  }
+
+  DNode* slot = tryInsert(newAcct, (order < 0 ? node->_left : node->_right), inserted);
+  updateHeight(node);
+  if(checkImbalance(node) > 1 || checkImbalance(node) < -1)
+    rebalance(node);
+  return slot;
+}
+
+UNode* UTree::remover(std::string_view username, UNode*& node){
+  if(node == nullptr)
+    return nullptr;
+
+  own(node);
+  int order = username.compare(node->getUsername());
+  if(order < 0)
+    node->_left = remover(username, node->_left);
   else{
-    if(newAcct.getUsername() < node->getUsername()){
-        node->_left = insert(newAcct, node->_left);
-        updateHeight(node);
-        //if(checkImbalance(node) > 1)
-	//rebalance(node);
-         return node;
-      }
+    if(order > 0)
+      node->_right = remover(username, node->_right);
     else{
-      if(newAcct.getUsername() > node->getUsername()){
-          node->_right = insert(newAcct, node->_right);
-          updateHeight(node);
-          //if(checkImbalance(node) > 1)
-	  //rebalance(node);
-          return node;
+      if(node->_left == nullptr || node->_right == nullptr){
+        //zero or one child, splice the node out
+        UNode* child = (node->_left != nullptr ? node->_left : node->_right);
+        _dtreePool.destroy(node->_dtree);
+        _unodePool.destroy(node);
+        return child;
       }
+
+      //two children, take over the successor's DTree and remove the successor instead.
+      //the doomed DTree is now leftmost in the right subtree so the search still finds it
+      UNode* successor = own(node->_right);
+      while(successor->_left != nullptr)
+        successor = own(successor->_left);
+      std::swap(node->_dtree, successor->_dtree);
+      std::swap(node->_username, successor->_username);
+      node->_right = remover(username, node->_right);
     }
   }
-  
-  return nullptr;
+
+  updateHeight(node);
+  if(checkImbalance(node) > 1 || checkImbalance(node) < -1)
+    rebalance(node);
+  return node;
+}
+
+UNode* UTree::rotateLeft(UNode* node){
+  UNode* pivot = own(node->_right);
+  node->_right = pivot->_left;
+  pivot->_left = node;
+
+  //the old root is now below the pivot so its height has to be fixed first
+  updateHeight(node);
+  updateHeight(pivot);
+  return pivot;
+}
+
+UNode* UTree::rotateRight(UNode* node){
+  UNode* pivot = own(node->_left);
+  node->_left = pivot->_right;
+  pivot->_right = node;
+
+  updateHeight(node);
+  updateHeight(pivot);
+  return pivot;
+}
+
+URangeIterator::URangeIterator(UNode* root, std::string_view lo, std::string_view hi, Bound bound):
+  _hi(hi), _bound(bound){
+  //keep the path to the smallest username >= lo, ancestors we pass to the right are below the range
+  UNode* node = root;
+  while(node != nullptr){
+    if(node->getUsername() >= lo){
+      _stack.push_back(node);
+      node = node->_left;
+    }
+    else
+      node = node->_right;
+  }
+  settle();
+}
+
+URangeIterator& URangeIterator::operator++(){
+  UNode* node = _stack.back();
+  _stack.pop_back();
+  pushLeftmost(node->_right);
+  settle();
+  return *this;
+}
+
+void URangeIterator::pushLeftmost(UNode* node){
+  while(node != nullptr){
+    _stack.push_back(node);
+    node = node->_left;
+  }
+}
+
+void URangeIterator::settle(){
+  //stop once the next username is past the upper bound
+  if(_stack.empty() || _bound == UNBOUNDED)
+    return;
+
+  const string& username = _stack.back()->getUsername();
+  bool past = (_bound == INCLUSIVE ? std::string_view(username) > _hi
+                                   : std::string_view(username).compare(0, _hi.size(), _hi) != 0);
+  if(past)
+    _stack.clear();
+}
+
+const char* UTree::mapFile(const string& infile, size_t& length){
+    /* Check to make sure the file was opened */
+    int fd = open(infile.c_str(), O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0) {
+        if(fd >= 0) close(fd);
+        throw std::invalid_argument("File " + infile + " could not be opened or located");
+    }
+
+    length = static_cast<size_t>(info.st_size);
+    if(length == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    /* Map the whole file, the fields are parsed where they lie */
+    void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED)
+        throw std::invalid_argument("File " + infile + " could not be mapped");
+    madvise(mapped, length, MADV_SEQUENTIAL);
+
+    return static_cast<const char*>(mapped);
+}
+
+bool UTree::syncFile(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    bool synced = (_syncFd(fd) == 0);
+    ::close(fd);
+    return synced;
+}
+
+void UTree::reportBadLine(const string& infile, int lineNum, const string& message) {
+    /* Parallel loaders report from several threads, each line goes out whole */
+    static std::mutex reportLock;
+    std::lock_guard<std::mutex> guard(reportLock);
+    std::cerr << "loadData: " << infile << ":" << lineNum << ": " << message << endl;
+}
+
+template <class Sink>
+void UTree::parseLines(const char* begin, const char* end, const string& infile, int firstLine, Sink sink) {
+    const char delim = ',';
+    const int numFields = 5;
+    const char* fieldStart[numFields];
+    const char* fieldEnd[numFields];
+
+    const char* cursor = begin;
+    int lineNum = firstLine - 1;
+    while(cursor < end) {
+        lineNum++;
+        const char* lineEnd = static_cast<const char*>(memchr(cursor, '\n', end - cursor));
+        if(lineEnd == nullptr) lineEnd = end;
+        const char* nextLine = (lineEnd < end ? lineEnd + 1 : end);
+        if(lineEnd > cursor && lineEnd[-1] == '\r') lineEnd--;
+
+        /* Blank lines carry no account */
+        if(lineEnd == cursor) {
+            cursor = nextLine;
+            continue;
+        }
+
+        /* Split the line on the delimiter, memchr scans a word at a time */
+        int count = 0;
+        const char* field = cursor;
+        while(true) {
+            const char* next = static_cast<const char*>(memchr(field, delim, lineEnd - field));
+            if(count < numFields) {
+                fieldStart[count] = field;
+                fieldEnd[count] = (next != nullptr ? next : lineEnd);
+            }
+            count++;
+            if(next == nullptr) break;
+            field = next + 1;
+        }
+        cursor = nextLine;
+
+        if(count != numFields) {
+            reportBadLine(infile, lineNum, "expected " + std::to_string(numFields) + " fields deliminated by a '"
+                          + delim + "', found " + std::to_string(count));
+            continue;
+        }
+
+        int disc = 0;
+        int nitro = 0;
+        std::from_chars_result discResult = std::from_chars(fieldStart[1], fieldEnd[1], disc);
+        std::from_chars_result nitroResult = std::from_chars(fieldStart[2], fieldEnd[2], nitro);
+        if(discResult.ec != std::errc() || discResult.ptr != fieldEnd[1] ||
+           nitroResult.ec != std::errc() || nitroResult.ptr != fieldEnd[2]) {
+            reportBadLine(infile, lineNum, "discriminator and nitro must be integers");
+            continue;
+        }
+
+        /* Fields are interned straight from the mapped file */
+        auto view = [&](int i) {return std::string_view(fieldStart[i], fieldEnd[i] - fieldStart[i]);};
+        try {
+            sink(Account(view(0), disc, nitro, view(3), view(4)));
+        } catch(const std::out_of_range& e) {
+            reportBadLine(infile, lineNum, e.what());
+        }
+    }
+}
+
+void UTree::collectAccounts(UNode* node, std::vector<Account>& accounts) const{
+  if(node == nullptr)
+    return;
+
+  collectAccounts(node->_left, accounts);
+  node->_dtree->collectAccounts(accounts);
+  collectAccounts(node->_right, accounts);
+}
+
+void UTree::collectNodes(UNode* node, std::vector<UNode*>& userNodes) const{
+  if(node == nullptr)
+    return;
+
+  collectNodes(node->_left, userNodes);
+  userNodes.push_back(node);
+  collectNodes(node->_right, userNodes);
+}
+
+UNode* UTree::buildBalanced(std::vector<UNode*>& userNodes, int start, int end){
+  if(start > end)
+    return nullptr;
+
+  //an even split keeps sibling heights within one, so the result is already AVL balanced
+  int mid = start + (end - start)/2;
+  UNode* node = userNodes[mid];
+  node->_left = buildBalanced(userNodes, start, mid-1);
+  node->_right = buildBalanced(userNodes, mid+1, end);
+  updateHeight(node);
+
+  return node;
 }
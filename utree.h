@@ -8,39 +8,70 @@
 #pragma once
 
 #include "dtree.h"
+#include "acctindex.h"
 #include <fstream>
-#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+#include <cstdio>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <random>
+#include <memory>
 
 #define DEFAULT_HEIGHT 0
 
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NITRO_BIT 0x8000  /* Kept in the disc field, discriminators never reach it */
+#define SNAPSHOT_RECORD_SIZE 8
+#define SNAPSHOT_FNV_OFFSET 0xcbf29ce484222325ull
+#define SNAPSHOT_FNV_PRIME 0x100000001b3ull
+static const char SNAPSHOT_MAGIC[8] = {'U', 'T', 'S', 'N', 'A', 'P', '\0', '\0'};
+
+#define BATCH_LANES 16  /* Lookups in flight at once in retrieveUserBatch */
+
+/* How allocateDiscriminator picks among the free discriminators */
+enum DiscPolicy {LOWEST_FREE, RANDOM_FREE};
+
 class Grader;   /* For grading purposes */
 class Tester;   /* Forward declaration for testing class */
 
+/* One (username, discriminator) pair of a batched lookup */
+struct UserKey {
+    std::string_view username;
+    int disc;
+};
+
 class UNode {
     friend class Grader;
     friend class Tester;
     friend class UTree;
+    friend class URangeIterator;
 public:
-    UNode() {
-        _dtree = new DTree();
+    UNode(DTree* dtree, const string* username) {
+        _dtree = dtree;
+        _username = username;
         _height = DEFAULT_HEIGHT;
         _left = nullptr;
         _right = nullptr;
     }
 
-    ~UNode() {
-        delete _dtree;
-        _dtree = nullptr;
-    }
-
     /* Getters */
     DTree*& getDTree() {return _dtree;}
     int getHeight() const {return _height;}
-    string getUsername() const {return _dtree->getUsername();}
+    const string& getUsername() const {return *_username;}
 
 private:
+    /* The pooled username is cached here so searches never reach into the DTree */
+    const string* _username;
     DTree* _dtree;
     int _height;
+    RefCount _refs;     /* Trees and parents linking here, shared UNodes are copied before they change */
     UNode* _left;
     UNode* _right;
 
@@ -48,6 +79,50 @@ private:
 
 };
 
+/**
+ * In-order iterator over the UNodes of a UTree. It seeks to the first username at
+ * or after lo in O(log n) and stops at the first username past the upper bound,
+ * which is either a username, a prefix every visited username must share, or none.
+ * The bounds are views, so the strings behind them must outlive the iterator.
+ */
+class URangeIterator {
+public:
+    enum Bound {UNBOUNDED, INCLUSIVE, PREFIX};
+
+    URangeIterator(): _bound(UNBOUNDED) {}
+    URangeIterator(UNode* root, std::string_view lo, std::string_view hi, Bound bound);
+
+    UNode* operator*() const {return _stack.back();}
+    UNode* operator->() const {return _stack.back();}
+    URangeIterator& operator++();
+    bool operator==(const URangeIterator& rhs) const {return _stack.empty() == rhs._stack.empty()
+                                                              && (_stack.empty() || _stack.back() == rhs._stack.back());}
+    bool operator!=(const URangeIterator& rhs) const {return !(*this == rhs);}
+
+private:
+    std::vector<UNode*> _stack;
+    std::string_view _hi;
+    Bound _bound;
+
+    void pushLeftmost(UNode* node);
+    void settle();
+};
+
+/* A slice of a UTree in username order, usable in a range-based for loop */
+class URange {
+public:
+    URange(UNode* root, std::string_view lo, std::string_view hi, URangeIterator::Bound bound):
+        _root(root), _lo(lo), _hi(hi), _bound(bound) {}
+    URangeIterator begin() const {return URangeIterator(_root, _lo, _hi, _bound);}
+    URangeIterator end() const {return URangeIterator();}
+
+private:
+    UNode* _root;
+    std::string_view _lo;
+    std::string_view _hi;
+    URangeIterator::Bound _bound;
+};
+
 class UTree {
     friend class Grader;
     friend class Tester;
@@ -58,14 +133,72 @@ public:
     /* IMPLEMENT: destructor */
     ~UTree();
 
+    /**
+     * Copies share every UNode and DNode with the source and path-copy them on
+     * change, so copying is O(1). A copy starts without secondary indexes.
+     */
+    UTree(const UTree& rhs);
+    UTree& operator=(const UTree& rhs);
+
     /* IMPLEMENT: Basic operations */
 
-    void loadData(string infile, bool append = true);
-    bool insert(Account newAcct);
-    bool removeUser(string username, int disc, DNode*& removed);
-    UNode* retrieve(string username);
-    DNode* retrieveUser(string username, int disc);
-    int numUsers(string username);
+    void loadData(string infile, bool append = true, bool bulk = false);
+    void loadDataParallel(string infile, int numThreads, bool append = true);
+    void bulkLoad(std::vector<Account>& accounts);
+    void saveSnapshot(string path, uint64_t generation = 0, bool durable = false) const;
+    uint64_t loadSnapshot(string path);
+    bool insert(const Account& newAcct);
+    std::pair<DNode*, bool> tryInsert(const Account& newAcct);
+    std::pair<DNode*, bool> emplace(std::string_view username, int disc, bool nitro,
+                                    std::string_view badge, std::string_view status);
+    /* Lookups take any string-like key without building a std::string */
+    bool removeUser(std::string_view username, int disc, Account& removed);
+    UNode* retrieve(std::string_view username) const;
+    DNode* retrieveUser(std::string_view username, int disc) const;
+    int numUsers(std::string_view username) const;
+    int numNitro(std::string_view username) const;
+    int numWithBadge(std::string_view username, std::string_view badge) const;
+
+    /* Optional secondary indexes, kept in step with every insertion and removal once enabled */
+    void enableIndex();
+    void disableIndex();
+    const AccountIndex* getIndex() const {return _index.get();}
+
+    /* Shape and counters, for finding out why lookups are slow */
+    UTreeStats stats() const;
+    void retrieveUserBatch(const UserKey keys[], int count, DNode* results[]) const;
+    int allocateDiscriminator(std::string_view username, DiscPolicy policy = LOWEST_FREE) const;
+
+    /* Ordered scans, O(log n + k) for k usernames visited */
+
+    URangeIterator begin() const {return URangeIterator(_root, "", "", URangeIterator::UNBOUNDED);}
+    URangeIterator end() const {return URangeIterator();}
+    URange rangeScan(std::string_view lo, std::string_view hi) const {
+        return URange(_root, lo, hi, URangeIterator::INCLUSIVE);
+    }
+    URange prefixScan(std::string_view prefix) const {
+        return URange(_root, prefix, prefix, URangeIterator::PREFIX);
+    }
+
+    /**
+     * Visits the users whose username starts with prefix, in username order.
+     * @param prefix prefix to match, empty matches every user
+     * @param visit callable taking the UNode of each matching username
+     * @param limit most usernames to visit, negative for no limit
+     * @return number of usernames visited
+     */
+    template <class Visitor>
+    int prefixScan(std::string_view prefix, Visitor visit, int limit = -1) const {
+        int count = 0;
+        for(URangeIterator it = prefixScan(prefix).begin(); it != end() && count != limit; ++it, ++count)
+            visit(*it);
+        return count;
+    }
+#ifdef HAVE_COROUTINE_LOOKUPS
+    /* Coroutine lookups for a LookupScheduler, the username's characters must outlive them */
+    Lookup<UNode*> retrieveAsync(std::string_view username) const;
+    Lookup<DNode*> retrieveUserAsync(std::string_view username, int disc) const;
+#endif
     void clear();
     void printUsers() const;
     void dump() const {dump(_root);}
@@ -84,10 +217,31 @@ public:
 
 private:
     UNode* _root;
+    SharedNodePool<UNode> _unodePool;  /* Owns every UNode in this tree, shared with its copies */
+    SharedNodePool<DTree> _dtreePool;  /* Owns the DTree of every UNode */
+    std::unique_ptr<AccountIndex> _index;  /* Secondary indexes, nullptr unless enabled */
+    static int (*_syncFd)(int fd);         /* fsync, the tester swaps it to make syncs fail */
 
     /* IMPLEMENT (optional): any additional helper functions here! */
-  UNode* retrieve(string username, UNode*& node);
+  UNode* retrieve(std::string_view username, UNode* node) const;
+  bool isShared(const UNode* node) const {return _unodePool.isShared() && node->_refs.isShared();}
+  UNode* own(UNode*& node);
+  UNode* ownPath(std::string_view username);
+  void release(UNode* node);
   void clear(UNode* node);
+  void addDepths(UNode* node, int depth, UTreeStats& stats) const;
+  void rebuildIndex();
   void printUsers(UNode* node) const;
-  UNode* insert(Account newAcct, UNode*& node);
+  DNode* tryInsert(const Account& newAcct, UNode*& node, bool& inserted);
+  UNode* remover(std::string_view username, UNode*& node);
+  UNode* rotateLeft(UNode* node);
+  UNode* rotateRight(UNode* node);
+  void collectAccounts(UNode* node, std::vector<Account>& accounts) const;
+  void collectNodes(UNode* node, std::vector<UNode*>& userNodes) const;
+  UNode* buildBalanced(std::vector<UNode*>& userNodes, int start, int end);
+  static const char* mapFile(const string& infile, size_t& length);
+  static void reportBadLine(const string& infile, int lineNum, const string& message);
+  static bool syncFile(const string& path);
+  template <class Sink>
+  void parseLines(const char* begin, const char* end, const string& infile, int firstLine, Sink sink);
 };